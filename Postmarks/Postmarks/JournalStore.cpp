@@ -0,0 +1,366 @@
+#include "JournalStore.h"
+#include "Postmarks.h"
+
+#include <algorithm>
+#include <filesystem>
+
+#if defined(WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	// op, device length, pm, range id. Followed by the device and a check
+	const size_t HDR_LEN = 1 + 2 + 4 + 8;
+	const size_t CHECK_LEN = 4;
+
+	void putLE(std::string& buf, uint64_t v, int bytes)
+	{
+		for (int i = 0; i < bytes; ++i)
+			buf.push_back((char)((v >> (i * 8)) & 0xff));
+	}
+
+	uint64_t getLE(const char* p, int bytes)
+	{
+		uint64_t v = 0;
+		for (int i = 0; i < bytes; ++i)
+			v |= (uint64_t)(uint8_t)p[i] << (i * 8);
+		return v;
+	}
+
+	uint32_t check(const char* p, size_t len)
+	{
+		// FNV-1a. Only has to catch a torn write, not tampering
+		uint32_t h = 2166136261U;
+		for (size_t i = 0; i < len; ++i)
+		{
+			h ^= (uint8_t)p[i];
+			h *= 16777619U;
+		}
+		return h;
+	}
+}
+
+JournalStore::JournalStore(Logging::LogFile& log)
+	: Logging::LogClient(log)
+{
+}
+
+JournalStore::~JournalStore()
+{
+	close();
+}
+
+void JournalStore::encode(std::string& buf, Op op, const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	size_t start = buf.size();
+	putLE(buf, op, 1);
+	putLE(buf, devId.size(), 2);
+	putLE(buf, pm, 4);
+	putLE(buf, (uint64_t)rangeId, 8);
+	buf.append(devId);
+	putLE(buf, check(buf.data() + start, buf.size() - start), 4);
+}
+
+size_t JournalStore::decode(const char* p, size_t len, Pending& r)
+{
+	// 0 for a short or damaged record
+	if (len < HDR_LEN)
+		return 0;
+
+	size_t devLen = getLE(p + 1, 2);
+	size_t recLen = HDR_LEN + devLen + CHECK_LEN;
+	if (len < recLen || getLE(p + HDR_LEN + devLen, 4) != check(p, HDR_LEN + devLen))
+		return 0;
+
+	r.op = (Op)p[0];
+	if (r.op != Upsert && r.op != Delete && r.op != Retag && r.op != Touch)
+		return 0;
+
+	r.pm = (uint32_t)getLE(p + 3, 4);
+	r.rangeId = (int64_t)getLE(p + 7, 8);
+	r.devId.assign(p + HDR_LEN, devLen);
+	return recLen;
+}
+
+bool JournalStore::sync(std::FILE* f)
+{
+	if (std::fflush(f))
+		return false;
+#if defined(WIN32)
+	return _commit(_fileno(f)) == 0;
+#else
+	return fsync(fileno(f)) == 0;
+#endif
+}
+
+bool JournalStore::readFile(const std::string& file, std::string& data)
+{
+	data.clear();
+
+	std::FILE* f = std::fopen(file.c_str(), "rb");
+	if (!f)
+		return false;
+
+	char buf[65536];
+	size_t n;
+	while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, n);
+
+	bool ok = !std::ferror(f);
+	std::fclose(f);
+	return ok;
+}
+
+void JournalStore::apply(const Pending& r)
+{
+	switch (r.op)
+	{
+	case Upsert:
+		MemoryStore::upsert(r.devId, r.pm, r.rangeId);
+		break;
+	case Delete:
+		MemoryStore::remove(r.devId);
+		break;
+	case Retag:
+		MemoryStore::retag(r.devId, r.pm, r.rangeId);
+		break;
+	case Touch:
+		MemoryStore::touch(r.devId, r.rangeId);
+		break;
+	}
+}
+
+size_t JournalStore::replay(const std::string& data, size_t offset)
+{
+	// Returns how far it got. Anything past that is a torn or damaged tail
+	Pending r;
+	size_t n;
+	while (offset < data.size() && (n = decode(data.data() + offset, data.size() - offset, r)) > 0)
+	{
+		apply(r);
+		offset += n;
+		++m_journalRecords;
+	}
+	return offset;
+}
+
+bool JournalStore::open(const std::string& location)
+{
+	close();
+
+	scheme(location, m_file);
+
+	std::string data;
+	if (readFile(m_file, data))
+	{
+		if (data.size() < 16 || getLE(data.data(), 4) != SNAP_MAGIC)
+		{
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Journal snapshot " << m_file << " is not a snapshot");
+			MemoryStore::close();
+			return false;
+		}
+
+		uint64_t count = getLE(data.data() + 8, 8);
+		size_t end = replay(data, 16);
+		if (end != data.size() || m_journalRecords != count)
+		{
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Journal snapshot " << m_file << " is damaged at offset " << end);
+			MemoryStore::close();
+			return false;
+		}
+		m_journalRecords = 0;
+	}
+
+	std::string logFile = m_file + ".log";
+	if (readFile(logFile, data))
+	{
+		m_journalBytes = replay(data, 0);
+		if (m_journalBytes != data.size())
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Discarding " << data.size() - m_journalBytes << " bytes of torn journal at the end of " << logFile);
+	}
+
+	if (!openJournal())
+	{
+		MemoryStore::close();
+		return false;
+	}
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Loaded " << size() << " postmarks, replayed " << m_journalRecords << " journal records");
+	return true;
+}
+
+void JournalStore::close()
+{
+	if (m_journal)
+		std::fclose(m_journal);
+	m_journal = nullptr;
+	m_journalBytes = 0;
+	m_journalRecords = 0;
+	m_pending.clear();
+
+	MemoryStore::close();
+}
+
+bool JournalStore::openJournal()
+{
+	// Anything past m_journalBytes is torn or from a write that failed part
+	// way, and would stop a replay short of whatever is appended after it
+	if (m_journal)
+		std::fclose(m_journal);
+
+	std::string logFile = m_file + ".log";
+	std::error_code ec;
+	if (std::filesystem::exists(logFile, ec))
+		std::filesystem::resize_file(logFile, m_journalBytes, ec);
+
+	m_journal = ec ? nullptr : std::fopen(logFile.c_str(), "ab");
+	if (!m_journal)
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open journal " << logFile << " " << ec.message());
+	return m_journal != nullptr;
+}
+
+bool JournalStore::begin()
+{
+	m_pending.clear();
+	m_buf.clear();
+
+	// Left closed by a failure, tried again with every batch
+	return m_journal || (!m_file.empty() && openJournal());
+}
+
+bool JournalStore::upsert(const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	if (devId.size() > MAX_DEVID)
+		return false;
+
+	encode(m_buf, Upsert, devId, pm, rangeId);
+	m_pending.push_back({ Upsert, devId, pm, rangeId });
+	return true;
+}
+
+bool JournalStore::remove(const std::string& devId)
+{
+	if (devId.size() > MAX_DEVID)
+		return false;
+
+	encode(m_buf, Delete, devId, 0, 0);
+	m_pending.push_back({ Delete, devId, 0, 0 });
+	return true;
+}
+
+bool JournalStore::retag(const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	if (devId.size() > MAX_DEVID)
+		return false;
+
+	encode(m_buf, Retag, devId, pm, rangeId);
+	m_pending.push_back({ Retag, devId, pm, rangeId });
+	return true;
+}
+
+bool JournalStore::touch(const std::string& devId, int64_t lastSeen)
+{
+	if (devId.size() > MAX_DEVID)
+		return false;
+
+	encode(m_buf, Touch, devId, 0, lastSeen);
+	m_pending.push_back({ Touch, devId, 0, lastSeen });
+	return true;
+}
+
+bool JournalStore::commit()
+{
+	// The whole batch goes down in one write and one fsync. Lookups only see
+	// it once it is durable
+	if (std::fwrite(m_buf.data(), 1, m_buf.size(), m_journal) != m_buf.size() || !sync(m_journal))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error writing " << m_pending.size() << " postmarks to journal " << m_file << ".log");
+		m_pending.clear();
+		openJournal();
+		return false;
+	}
+
+	for (const Pending& r : m_pending)
+		apply(r);
+	m_journalBytes += m_buf.size();
+	m_journalRecords += m_pending.size();
+	m_pending.clear();
+	return true;
+}
+
+bool JournalStore::idle()
+{
+	// Not tried again until the journal has grown as much again
+	if (!m_journal || m_journalRecords <= COMPACT_MIN || m_journalRecords <= size() || m_journalRecords < m_compactAfter)
+		return false;
+
+	if (!compact())
+		m_compactAfter = m_journalRecords * 2;
+	return false;
+}
+
+bool JournalStore::compact()
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// A device that has been seen gets a Touch straight after its Upsert
+	std::vector<Pending> rows;
+	loadAll([&](const std::string& devId, uint32_t pm, int64_t rangeId, bool, int64_t lastSeen)
+	{
+		rows.push_back({ Upsert, devId, pm, rangeId });
+		if (lastSeen)
+			rows.push_back({ Touch, devId, 0, lastSeen });
+	});
+	std::stable_sort(rows.begin(), rows.end(), [](const Pending& a, const Pending& b) { return a.devId < b.devId; });
+
+	std::string buf;
+	putLE(buf, SNAP_MAGIC, 4);
+	putLE(buf, 0, 4);
+	putLE(buf, rows.size(), 8);
+	for (const Pending& r : rows)
+		encode(buf, r.op, r.devId, r.pm, r.rangeId);
+
+	// Written aside and renamed over the old snapshot, so a crash at any point
+	// leaves either the old snapshot and the full journal or the new snapshot
+	// and a journal that replays over it harmlessly
+	std::string tmp = m_file + ".tmp";
+	std::FILE* f = std::fopen(tmp.c_str(), "wb");
+	bool ok = f && std::fwrite(buf.data(), 1, buf.size(), f) == buf.size() && sync(f);
+	if (f)
+		std::fclose(f);
+
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(tmp, m_file, ec);
+	if (!ok || ec)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error compacting journal into " << m_file << " " << ec.message());
+		std::filesystem::remove(tmp, ec);
+		return false;
+	}
+
+#if !defined(WIN32)
+	// Make the rename itself durable before the journal goes
+	std::string dir = std::filesystem::absolute(m_file).parent_path().string();
+	int fd = ::open(dir.c_str(), O_RDONLY);
+	if (fd >= 0)
+	{
+		fsync(fd);
+		::close(fd);
+	}
+#endif
+
+	// Everything in the journal is in the snapshot now. If it can't be
+	// reopened begin() keeps trying
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Compacted " << m_journalRecords << " journal records into " << size() << " postmarks in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms");
+	m_journalBytes = 0;
+	m_journalRecords = 0;
+	m_compactAfter = 0;
+	openJournal();
+	return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "MemoryStore.h"
+
+#include <cstdio>
+#include <vector>
+
+// Keeps the device to postmark map in memory and makes it durable by
+// appending fixed format records to a journal, one write and one fsync per
+// batch. Once the journal outgrows the live set it is compacted into a
+// snapshot sorted by device and truncated, when the writer is next idle. open() loads the snapshot then
+// replays the journal over it, discarding a torn record at the end.
+//
+//   <path>         snapshot
+//   <path>.log     journal
+class JournalStore : public MemoryStore, public Logging::LogClient
+{
+public:
+	enum Op : uint8_t { Upsert = 1, Delete = 2, Retag = 3, Touch = 4 }; // Touch keeps the time in the range id
+
+	explicit JournalStore(Logging::LogFile& log);
+	~JournalStore();
+
+	bool open(const std::string& location) override;
+	void close() override;
+
+	bool begin() override;
+	bool upsert(const std::string& devId, uint32_t pm, int64_t rangeId) override;
+	bool remove(const std::string& devId) override;
+	bool retag(const std::string& devId, uint32_t pm, int64_t rangeId) override;
+	bool touch(const std::string& devId, int64_t lastSeen) override;
+	bool commit() override;
+	bool idle() override;
+
+private:
+	static const uint32_t SNAP_MAGIC = 0x50414e53; // "SNAP"
+	static const size_t MAX_DEVID = 0xffff; // length is stored in two bytes
+	static const size_t COMPACT_MIN = 100000; // journal records before compaction is considered
+
+	struct Pending
+	{
+		Op op;
+		std::string devId;
+		uint32_t pm;
+		int64_t rangeId;
+	};
+
+	std::string m_file;
+	std::FILE* m_journal = nullptr;
+	size_t m_journalBytes = 0; // all good up to here
+	size_t m_journalRecords = 0;
+	size_t m_compactAfter = 0; // records, after a failed compaction
+	std::vector<Pending> m_pending;
+	std::string m_buf;
+
+	static void encode(std::string& buf, Op op, const std::string& devId, uint32_t pm, int64_t rangeId);
+	static size_t decode(const char* p, size_t len, Pending& r);
+	static bool sync(std::FILE* f);
+
+	bool readFile(const std::string& file, std::string& data);
+	size_t replay(const std::string& data, size_t offset);
+	void apply(const Pending& r);
+	bool openJournal();
+	bool compact();
+};
@@ -0,0 +1,117 @@
+#include "Latency.h"
+
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram()
+{
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		m_buckets[i] = 0;
+		m_base[i] = 0;
+	}
+}
+
+int LatencyHistogram::bucket(uint64_t ns)
+{
+	// Values below SUBS get a bucket each, then SUBS per power of two
+	if (ns < SUBS)
+		return (int)ns;
+
+	int msb = 63;
+	while (!(ns >> msb))
+		--msb;
+
+	int shift = msb - SUB_BITS;
+	return (shift + 1) * SUBS + (int)((ns >> shift) & (SUBS - 1));
+}
+
+uint64_t LatencyHistogram::upper(int bucket)
+{
+	if (bucket < SUBS)
+		return bucket;
+
+	int shift = bucket / SUBS - 1;
+	uint64_t base = (uint64_t)(SUBS + bucket % SUBS) << shift;
+	return base + ((uint64_t)1 << shift) - 1;
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration d)
+{
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	uint64_t v = ns > 0 ? ns : 0;
+
+	m_buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(v, std::memory_order_relaxed);
+
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+	while (v > max && !m_max.compare_exchange_weak(max, v, std::memory_order_relaxed))
+		;
+}
+
+LatencyHistogram::Summary LatencyHistogram::summary(bool reset)
+{
+	std::lock_guard<std::mutex> lk(m_baseLk);
+
+	uint64_t counts[BUCKETS];
+	uint64_t total = 0;
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		uint64_t now = m_buckets[i].load(std::memory_order_relaxed);
+		counts[i] = now - m_base[i];
+		total += counts[i];
+		if (reset)
+			m_base[i] = now;
+	}
+
+	Summary s{};
+	uint64_t sumNow = m_sum.load(std::memory_order_relaxed);
+	uint64_t sum = sumNow - m_baseSum;
+	s.max = reset ? m_max.exchange(0) : m_max.load();
+	if (reset)
+		m_baseSum = sumNow;
+
+	// Counted from the buckets so the percentiles agree with each other
+	s.count = total;
+	if (!total)
+		return s;
+	s.mean = sum / total;
+
+	// Each percentile is reported as the top of its bucket, capped at the max
+	uint64_t* ps[] = { &s.p50, &s.p90, &s.p99, &s.p999 };
+	const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t seen = 0;
+	int q = 0;
+	for (int i = 0; i < BUCKETS && q < 4; ++i)
+	{
+		seen += counts[i];
+		while (q < 4 && seen >= qs[q] * total)
+			*ps[q++] = std::min(upper(i), s.max);
+	}
+	return s;
+}
+
+LatencyHistogram::Totals LatencyHistogram::totals() const
+{
+	Totals t{};
+	t.sum = m_sum.load(std::memory_order_relaxed) / 1e9;
+
+	// Folded to one bucket per power of two from about 1us to 68s, always
+	// the same ones so a scraper sees a fixed set
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		uint64_t top = upper(i) + 1;
+		if (i % SUBS == SUBS - 1 && top >= TOTALS_FROM && top <= TOTALS_TO)
+			t.buckets.push_back({ top / 1e9, seen });
+	}
+	t.count = seen;
+	return t;
+}
+
+std::ostream& operator<<(std::ostream& os, const LatencyHistogram::Summary& s)
+{
+	// Microseconds, which is the scale everything else is logged in
+	return os << s.count << " mean " << s.mean / 1000.0 << "us p50 " << s.p50 / 1000.0 << " p90 " << s.p90 / 1000.0 << " p99 " << s.p99 / 1000.0
+		<< " p99.9 " << s.p999 / 1000.0 << " max " << s.max / 1000.0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+// HDR-style histogram of durations, cheap enough to record every request.
+// Values are bucketed by power of two with eight linear steps in each, so a
+// percentile is within 12.5% across nanoseconds to minutes. Recording is a
+// few relaxed atomic adds and never takes a lock.
+//
+// The counts only ever go up so they can be scraped as they are. Intervals
+// for the log are the difference from the last reset.
+class LatencyHistogram
+{
+	static const int SUB_BITS = 3;
+	static const int SUBS = 1 << SUB_BITS;
+	static const int BUCKETS = (64 - SUB_BITS + 1) * SUBS;
+	static const uint64_t TOTALS_FROM = (uint64_t)1 << 10; // ns
+	static const uint64_t TOTALS_TO = (uint64_t)1 << 36;
+
+	std::atomic<uint64_t> m_buckets[BUCKETS];
+	std::atomic<uint64_t> m_sum{0};
+	std::atomic<uint64_t> m_max{0}; // since the last reset
+
+	std::mutex m_baseLk;
+	uint64_t m_base[BUCKETS];
+	uint64_t m_baseSum = 0;
+
+	static int bucket(uint64_t ns);
+	static uint64_t upper(int bucket);
+
+public:
+	// In nanoseconds
+	struct Summary
+	{
+		uint64_t count;
+		uint64_t mean;
+		uint64_t p50;
+		uint64_t p90;
+		uint64_t p99;
+		uint64_t p999;
+		uint64_t max;
+	};
+
+	// Since start. Cumulative counts at each power of two, keyed on the upper
+	// bound in seconds
+	struct Totals
+	{
+		std::vector<std::pair<double, uint64_t> > buckets;
+		uint64_t count;
+		double sum; // seconds
+	};
+
+	LatencyHistogram();
+
+	void record(std::chrono::steady_clock::duration d);
+
+	// Since the last reset, and reset starts a new interval. Anything recorded
+	// while it runs may land in either
+	Summary summary(bool reset);
+
+	Totals totals() const;
+};
+
+std::ostream& operator<<(std::ostream& os, const LatencyHistogram::Summary& s);
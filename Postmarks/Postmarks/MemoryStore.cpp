@@ -0,0 +1,148 @@
+#include "MemoryStore.h"
+
+#include <algorithm>
+
+bool MemoryStore::open(const std::string&)
+{
+	return true;
+}
+
+void MemoryStore::close()
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	m_devices.clear();
+	m_pms.clear();
+}
+
+bool MemoryStore::get(const std::string& devId, uint32_t& pm)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	std::unordered_map<std::string, Entry>::const_iterator it = m_devices.find(devId);
+	if (it == m_devices.end())
+		return false;
+
+	pm = it->second.pm;
+	return true;
+}
+
+bool MemoryStore::held(uint32_t from, uint32_t to, size_t limit, Held& out)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	// Nothing here is ordered, so a whole pass over the postmarks
+	Held found;
+	for (const std::pair<const uint32_t, std::string>& p : m_pms)
+		if (p.first >= from && p.first <= to)
+			found.push_back({ p.second, p.first });
+
+	std::sort(found.begin(), found.end(), [](const Held::value_type& a, const Held::value_type& b) { return a.second < b.second; });
+	bool more = found.size() > limit;
+	if (more)
+		found.resize(limit);
+	out.insert(out.end(), found.begin(), found.end());
+	return more;
+}
+
+size_t MemoryStore::size()
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	return m_devices.size();
+}
+
+bool MemoryStore::loadAll(RowFn fn)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	for (const std::pair<const std::string, Entry>& d : m_devices)
+		fn(d.first, d.second.pm, d.second.rangeId, d.second.tagged, d.second.lastSeen);
+	return true;
+}
+
+bool MemoryStore::loadUnknown(const std::set<int64_t>& ranges, RowFn fn)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	for (const std::pair<const std::string, Entry>& d : m_devices)
+		if (!d.second.tagged || !ranges.count(d.second.rangeId))
+			fn(d.first, d.second.pm, d.second.rangeId, d.second.tagged, d.second.lastSeen);
+	return true;
+}
+
+bool MemoryStore::scan(Cursor& cursor, size_t limit, RowFn fn)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	// A bucket at a time, the cursor being the next bucket. A rehash between
+	// calls only moves where the rest of the pass is
+	size_t n = 0;
+	size_t bucket = cursor.pos;
+	for (; bucket < m_devices.bucket_count() && n < limit; ++bucket)
+		for (std::unordered_map<std::string, Entry>::const_local_iterator d = m_devices.cbegin(bucket); d != m_devices.cend(bucket); ++d, ++n)
+			fn(d->first, d->second.pm, d->second.rangeId, d->second.tagged, d->second.lastSeen);
+
+	cursor.started = true;
+	cursor.pos = bucket;
+	cursor.done = bucket >= m_devices.bucket_count();
+	return true;
+}
+
+int64_t MemoryStore::erase(const std::string& devId)
+{
+	// Returns when the device was last seen
+	int64_t lastSeen = 0;
+	std::unordered_map<std::string, Entry>::iterator it = m_devices.find(devId);
+	if (it != m_devices.end())
+	{
+		lastSeen = it->second.lastSeen;
+		m_pms.erase(it->second.pm);
+		m_devices.erase(it);
+	}
+	return lastSeen;
+}
+
+bool MemoryStore::upsert(const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	int64_t lastSeen = erase(devId);
+
+	std::unordered_map<uint32_t, std::string>::iterator it = m_pms.find(pm);
+	if (it != m_pms.end())
+		erase(std::string(it->second));
+
+	m_devices[devId] = { pm, rangeId, true, lastSeen };
+	m_pms[pm] = devId;
+	return true;
+}
+
+bool MemoryStore::remove(const std::string& devId)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	erase(devId);
+	return true;
+}
+
+bool MemoryStore::retag(const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	std::unordered_map<std::string, Entry>::iterator it = m_devices.find(devId);
+	if (it != m_devices.end() && it->second.pm == pm)
+	{
+		it->second.rangeId = rangeId;
+		it->second.tagged = true;
+	}
+	return true;
+}
+
+bool MemoryStore::touch(const std::string& devId, int64_t lastSeen)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	std::unordered_map<std::string, Entry>::iterator it = m_devices.find(devId);
+	if (it != m_devices.end())
+		it->second.lastSeen = lastSeen;
+	return true;
+}
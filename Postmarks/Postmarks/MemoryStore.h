@@ -0,0 +1,44 @@
+#pragma once
+
+#include "PmStore.h"
+
+#include <mutex>
+#include <unordered_map>
+
+// Keeps assignments in memory only. For tests, benchmarks and load runs where
+// disk I/O would skew the results. Nothing survives a restart.
+class MemoryStore : public PmStore
+{
+	struct Entry
+	{
+		uint32_t pm;
+		int64_t rangeId;
+		bool tagged;
+		int64_t lastSeen;
+	};
+
+	std::mutex m_lk;
+	std::unordered_map<std::string, Entry> m_devices;
+	std::unordered_map<uint32_t, std::string> m_pms; // Keeps pm unique like the db's primary key
+
+	int64_t erase(const std::string& devId);
+
+public:
+	bool open(const std::string& location) override;
+	void close() override;
+
+	bool get(const std::string& devId, uint32_t& pm) override;
+	bool held(uint32_t from, uint32_t to, size_t limit, Held& out) override;
+	size_t size();
+
+	bool loadAll(RowFn fn) override;
+	bool loadUnknown(const std::set<int64_t>& ranges, RowFn fn) override;
+	bool scan(Cursor& cursor, size_t limit, RowFn fn) override;
+
+	bool begin() override { return true; }
+	bool upsert(const std::string& devId, uint32_t pm, int64_t rangeId) override;
+	bool remove(const std::string& devId) override;
+	bool retag(const std::string& devId, uint32_t pm, int64_t rangeId) override;
+	bool touch(const std::string& devId, int64_t lastSeen) override;
+	bool commit() override { return true; }
+};
@@ -97,6 +97,23 @@ public:
 		friend class Nmrh::NumericRangeHandler<N>;
 		typedef std::set<NumericRange> NRSet;
 		NRSet m_s;
+
+		// The range holding num, or end(). Ranges never overlap so this is the
+		// last one starting at or below num
+		typename NRSet::const_iterator find(N num) const
+		{
+			typename NRSet::const_iterator it = m_s.upper_bound(NumericRange(num, std::numeric_limits<N>::max()));
+			if (it == m_s.begin() || (--it)->m_to < num)
+				return m_s.end();
+			return it;
+		}
+		typename NRSet::iterator find(N num)
+		{
+			typename NRSet::iterator it = m_s.upper_bound(NumericRange(num, std::numeric_limits<N>::max()));
+			if (it == m_s.begin() || (--it)->m_to < num)
+				return m_s.end();
+			return it;
+		}
 	public:
 		NumericRangeList(void)
 		{
@@ -125,21 +142,60 @@ public:
 
 		bool getRangeForNumber(N num, NumericRange &range) const
 		{
-			for (typename NRSet::const_iterator it = m_s.begin(); it != m_s.end() && it->m_from <= num; ++it)
-				if (it->m_to >= num)
+			typename NRSet::const_iterator it = find(num);
+			if (it == m_s.end())
+				return false;
+			range = *it;
+			return true;
+		}
+
+		bool contains(N num) const
+		{
+			return find(num) != m_s.end();
+		}
+
+		// Lowest number in the list that also lies within r
+		bool getLowestIn(const NumericRange& r, N& num) const
+		{
+			typename NRSet::const_iterator it = m_s.upper_bound(NumericRange(r.m_from, std::numeric_limits<N>::max()));
+			if (it != m_s.begin())
+			{
+				typename NRSet::const_iterator prv = it;
+				if ((--prv)->m_to >= r.m_from)
 				{
-					range = *it;
+					num = r.m_from;
 					return true;
 				}
+			}
+			if (it != m_s.end() && it->m_from <= r.m_to)
+			{
+				num = it->m_from;
+				return true;
+			}
 			return false;
 		}
 
-		bool contains(N num) const
+		// How many numbers in the list lie within r, and in how many pieces
+		N countIn(const NumericRange& r, size_t* pieces = nullptr) const
 		{
-			for (typename NRSet::const_iterator it = m_s.begin(); it != m_s.end() && it->m_from <= num; ++it)
-				if (it->m_to >= num)
-					return true;
-			return false;
+			N e = std::numeric_limits<N>::is_integer ? 1 : std::numeric_limits<N>::epsilon();
+			N ret = 0;
+			size_t cnt = 0;
+			typename NRSet::const_iterator it = m_s.upper_bound(NumericRange(r.m_from, std::numeric_limits<N>::max()));
+			if (it != m_s.begin())
+				--it;
+			for (; it != m_s.end() && it->m_from <= r.m_to; ++it)
+			{
+				NumericRange i = it->intersect(r);
+				if (!i.invalid())
+				{
+					ret += (i.m_to - i.m_from) + e;
+					++cnt;
+				}
+			}
+			if (pieces)
+				*pieces = cnt;
+			return ret;
 		}
 
 		NumericRangeList& invert()
@@ -184,7 +240,7 @@ public:
 						m_s.erase(it2);
 						if (ittmp ==m_s.end())
 							break;
-						it2 == ittmp;
+						it2 = ittmp;
 						continue;
 					}
 					else
@@ -199,36 +255,29 @@ public:
 		bool addNum(N n)
 		{
 			N e = std::numeric_limits<N>::is_integer ? 1 : std::numeric_limits<N>::epsilon();
-			bool ret = false;
-			for (typename std::set<NumericRange>::iterator it = m_s.begin(); it != m_s.end(); ++it)
+			typename NRSet::iterator it = find(n);
+			if (it == m_s.end())
+				return false;
+
+			// We can do a const_cast here safely because
+			// the we will never invalidate the sort order of the set
+			NumericRange &l_nr = const_cast<NumericRange&>(*it);
+			if (n == l_nr.m_to)
 			{
-				// We can do a const_cast here safely because
-				// the we will never invalidate the sort order of the set
-				NumericRange &l_nr = const_cast<NumericRange&>(*it);
-				if (n <= l_nr.m_to)
-				{
-					if (n == l_nr.m_to)
-					{
-						if (l_nr.m_from == l_nr.m_to)
-							m_s.erase(it);
-						else
-							l_nr.m_to = n - e; //
-					}
-					else if (n == l_nr.m_from)
-						l_nr.m_from = n + e; //
-					else if (n > l_nr.m_from)
-					{
-						N x = l_nr.m_from;
-						l_nr.m_from = n + e; //
-						m_s.insert(NumericRange(x, n - e));
-					}
-					else
-						break;
-					ret = true;
-					break;
-				}
+				if (l_nr.m_from == l_nr.m_to)
+					m_s.erase(it);
+				else
+					l_nr.m_to = n - e; //
 			}
-			return ret;
+			else if (n == l_nr.m_from)
+				l_nr.m_from = n + e; //
+			else
+			{
+				N x = l_nr.m_from;
+				l_nr.m_from = n + e; //
+				m_s.insert(it, NumericRange(x, n - e));
+			}
+			return true;
 		}
 
 		NumericRangeList& operator += (N n)
@@ -240,41 +289,30 @@ public:
 		bool removeNum(N n)
 		{
 			N e = std::numeric_limits<N>::is_integer ? 1 : std::numeric_limits<N>::epsilon();
-			typename NRSet::iterator it = m_s.begin();
-			typename NRSet::const_iterator prv = m_s.end();
-			for (; it != m_s.end(); ++it)
+			typename NRSet::iterator it = m_s.upper_bound(NumericRange(n, std::numeric_limits<N>::max()));
+			typename NRSet::iterator prv = m_s.end();
+			if (it != m_s.begin())
 			{
-				if (n >= it->m_from && n <= it->m_to)
-					return false;
-				if (n < it->m_from)
-					break;
 				prv = it;
+				if ((--prv)->m_to >= n)
+					return false;
 			}
+
 			// We can do a const_cast here safely because
 			// the we will never invalidate the sort order of the set
-			NumericRange &l_nr = const_cast<NumericRange&>(*it);
-			if (prv != m_s.end())
+			bool joinPrv = prv != m_s.end() && prv->m_to + e == n;
+			bool joinNxt = it != m_s.end() && n + e == it->m_from;
+			if (joinPrv && joinNxt)
 			{
-				NumericRange &l_pnr = const_cast<NumericRange&>(*prv);
-				if (n - e == l_pnr.m_to && n + e == l_nr.m_from)
-				{
-					l_pnr.m_to = l_nr.m_to;
-					m_s.erase(it);
-				}
-				else if (n - e == l_pnr.m_to)
-					l_pnr.m_to = n;
-				else if (n + e == l_nr.m_from)
-					l_nr.m_from = n;
-				else
-					m_s.insert(NumericRange(n,n));
+				const_cast<NumericRange&>(*prv).m_to = it->m_to;
+				m_s.erase(it);
 			}
+			else if (joinPrv)
+				const_cast<NumericRange&>(*prv).m_to = n;
+			else if (joinNxt)
+				const_cast<NumericRange&>(*it).m_from = n;
 			else
-			{
-				if (n + e == l_nr.m_from)
-					l_nr.m_from = n;
-				else
-					m_s.insert(NumericRange(n,n));
-			}
+				m_s.insert(it, NumericRange(n,n));
 			return true;
 		}
 
@@ -303,6 +341,48 @@ public:
 		}
 	};
 
+	// A window onto a handler limited to one range of numbers. Any number of
+	// views can share a handler, so a number used through one of them is used
+	// in all of them without being recorded more than once
+	class View
+	{
+		NumericRangeHandler<N>* m_h;
+		NumericRange m_bounds;
+	public:
+		View(NumericRangeHandler<N>& h, const NumericRange& bounds) : m_h(&h), m_bounds(bounds) {}
+
+		const NumericRange& bounds() const { return m_bounds; }
+		bool inBounds(N n) const { return n >= m_bounds.m_from && n <= m_bounds.m_to; }
+
+		bool full() const
+		{
+			N n;
+			return !m_h->ranges.getLowestIn(m_bounds, n);
+		}
+
+		N getLowestUnused() const
+		{
+			N n;
+			if (!m_h->ranges.getLowestIn(m_bounds, n))
+				return std::numeric_limits<N>::max();
+			return n;
+		}
+
+		N addLowestUnused()
+		{
+			N ret = getLowestUnused();
+			addNum(ret);
+			return ret;
+		}
+
+		// Numbers outside the view are never available through it
+		bool contains(N n) const { return !inBounds(n) || m_h->contains(n); }
+		bool addNum(N n) { return inBounds(n) && m_h->addNum(n); }
+		bool removeNum(N n) { return inBounds(n) && m_h->removeNum(n); }
+
+		N getUnused(size_t* pieces = nullptr) const { return m_h->ranges.countIn(m_bounds, pieces); }
+	};
+
 private:
 	NumericRangeList ranges;
 
@@ -396,7 +476,7 @@ public:
 //	{
 //	}
 
-	bool contains(N n)
+	bool contains(N n) const
 	{
 		return !ranges.contains(n);
 	}
@@ -405,6 +485,10 @@ public:
 	{
 		return ranges.addNum(n);
 	}
+	void swap(NumericRangeHandler<N>& n)
+	{
+		ranges.m_s.swap(n.ranges.m_s);
+	}
 	bool removeNum(N n)
 	{
 		return ranges.removeNum(n);
@@ -0,0 +1,293 @@
+#include "PmCache.h"
+
+#include <utility>
+
+namespace
+{
+	const size_t FILTER_START = 1 << 16; // devices in the first layer, each after holds twice as many
+	const size_t FILTER_BITS = 10; // per device, for about 1% false positives a layer
+	const int FILTER_PROBES = 7;
+
+	// FNV-1a, then a second hash mixed out of it for the probe stride
+	void hashes(const std::string& devId, uint64_t& h1, uint64_t& h2)
+	{
+		uint64_t h = 14695981039346656037ULL;
+		for (char c : devId)
+		{
+			h ^= (uint8_t)c;
+			h *= 1099511628211ULL;
+		}
+		h1 = h;
+
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		h2 = h | 1;
+	}
+}
+
+size_t PmCache::cost(const std::string& devId)
+{
+	// Near enough: the node, its share of the buckets, the place on the ring
+	// and the id if it is too long to be stored inline
+	size_t n = sizeof(Map::value_type) + 4 * sizeof(void*);
+	if (devId.size() >= sizeof(std::string))
+		n += devId.size() + 1;
+	return n;
+}
+
+void PmCache::budget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	m_budget = bytes;
+	if (!m_budget)
+	{
+		clear();
+		return;
+	}
+
+	if (m_filterBytes > m_budget)
+		dropFilter();
+	while (m_bytes > m_budget && !m_map.empty())
+		evict();
+}
+
+bool PmCache::enabled() const
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	return m_budget > 0;
+}
+
+PmCache::Found PmCache::get(const std::string& devId, uint32_t& pm)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	if (!m_budget)
+		return Unknown;
+
+	Map::iterator it = m_map.find(devId);
+	if (it != m_map.end())
+	{
+		it->second.referenced = true;
+		pm = it->second.pm;
+		++m_hits;
+		return Hit;
+	}
+
+	if (m_complete && !inFilter(devId))
+	{
+		++m_filtered;
+		return Absent;
+	}
+
+	++m_misses;
+	return Unknown;
+}
+
+void PmCache::put(const std::string& devId, uint32_t pm)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	if (!m_budget)
+		return;
+
+	addToFilter(devId);
+
+	Map::iterator it = m_map.find(devId);
+	if (it != m_map.end())
+	{
+		it->second.pm = pm;
+		it->second.referenced = true;
+		return;
+	}
+
+	size_t c = cost(devId);
+	while (m_bytes + c > m_budget && !m_map.empty())
+		evict();
+	if (m_bytes + c > m_budget)
+		return;
+
+	size_t pos;
+	if (!m_free.empty())
+	{
+		pos = m_free.back();
+		m_free.pop_back();
+	}
+	else
+	{
+		pos = m_ring.size();
+		m_ring.push_back(nullptr);
+	}
+
+	// Not referenced until looked up again, so a device seen only once is the
+	// first to go
+	it = m_map.emplace(devId, Slot{ pm, false, pos }).first;
+	m_ring[pos] = &*it;
+	m_bytes += c;
+}
+
+void PmCache::erase(const std::string& devId)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	Map::iterator it = m_map.find(devId);
+	if (it != m_map.end())
+		remove(it->second.pos);
+}
+
+void PmCache::seen(const std::string& devId)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	if (m_budget)
+		addToFilter(devId);
+}
+
+void PmCache::complete()
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	m_complete = m_budget > 0 && !m_overBudget;
+}
+
+void PmCache::swap(PmCache& o)
+{
+	std::lock(m_lk, o.m_lk);
+	std::lock_guard<std::mutex> lk1(m_lk, std::adopt_lock);
+	std::lock_guard<std::mutex> lk2(o.m_lk, std::adopt_lock);
+
+	std::swap(m_budget, o.m_budget);
+	std::swap(m_bytes, o.m_bytes);
+	m_map.swap(o.m_map);
+	m_ring.swap(o.m_ring);
+	m_free.swap(o.m_free);
+	std::swap(m_hand, o.m_hand);
+	m_filter.swap(o.m_filter);
+	std::swap(m_filterBytes, o.m_filterBytes);
+	std::swap(m_complete, o.m_complete);
+	std::swap(m_overBudget, o.m_overBudget);
+	std::swap(m_hits, o.m_hits);
+	std::swap(m_misses, o.m_misses);
+	std::swap(m_filtered, o.m_filtered);
+	std::swap(m_evictions, o.m_evictions);
+}
+
+PmCache::Stats PmCache::stats() const
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	return Stats{ m_map.size(), m_bytes, m_budget, m_filterBytes, m_complete, m_hits, m_misses, m_filtered, m_evictions };
+}
+
+void PmCache::evict()
+{
+	// Each entry passed over loses its referenced bit, so the hand finds a
+	// victim within one turn of the ring
+	while (true)
+	{
+		if (m_hand >= m_ring.size())
+			m_hand = 0;
+
+		Map::value_type* e = m_ring[m_hand++];
+		if (!e)
+			continue;
+		if (e->second.referenced)
+		{
+			e->second.referenced = false;
+			continue;
+		}
+
+		remove(e->second.pos);
+		++m_evictions;
+		return;
+	}
+}
+
+void PmCache::remove(size_t pos)
+{
+	Map::value_type* e = m_ring[pos];
+	m_bytes -= cost(e->first);
+	m_ring[pos] = nullptr;
+	m_free.push_back(pos);
+	m_map.erase(m_map.find(e->first));
+}
+
+void PmCache::clear()
+{
+	m_bytes = 0;
+	m_map.clear();
+	m_ring.clear();
+	m_free.clear();
+	m_hand = 0;
+	m_filter.clear();
+	m_filterBytes = 0;
+	m_complete = false;
+	m_overBudget = false;
+}
+
+void PmCache::addToFilter(const std::string& devId)
+{
+	// Lookups put devices already there, which would only fill it faster
+	if (m_overBudget || inFilter(devId))
+		return;
+
+	if (m_filter.empty() || m_filter.back().count >= m_filter.back().capacity)
+	{
+		size_t capacity = m_filter.empty() ? FILTER_START : m_filter.back().capacity * 2;
+		size_t words = (capacity * FILTER_BITS + 63) / 64;
+		size_t bytes = words * sizeof(uint64_t);
+		if (m_filterBytes + bytes > m_budget)
+		{
+			dropFilter();
+			return;
+		}
+
+		m_filter.push_back(Layer{ std::vector<uint64_t>(words), capacity, 0 });
+		m_filterBytes += bytes;
+		m_bytes += bytes;
+		while (m_bytes > m_budget && !m_map.empty())
+			evict();
+	}
+
+	uint64_t h1, h2;
+	hashes(devId, h1, h2);
+
+	Layer& l = m_filter.back();
+	uint64_t bits = l.bits.size() * 64;
+	for (int i = 0; i < FILTER_PROBES; ++i)
+	{
+		uint64_t b = (h1 + i * h2) % bits;
+		l.bits[b / 64] |= (uint64_t)1 << (b % 64);
+	}
+	++l.count;
+}
+
+void PmCache::dropFilter()
+{
+	// A filter missing devices would turn them away, so with no room for it
+	// every miss goes to the store
+	m_bytes -= m_filterBytes;
+	m_filterBytes = 0;
+	m_filter.clear();
+	m_complete = false;
+	m_overBudget = true;
+}
+
+bool PmCache::inFilter(const std::string& devId) const
+{
+	uint64_t h1, h2;
+	hashes(devId, h1, h2);
+
+	for (const Layer& l : m_filter)
+	{
+		uint64_t bits = l.bits.size() * 64;
+		int i = 0;
+		for (; i < FILTER_PROBES; ++i)
+		{
+			uint64_t b = (h1 + i * h2) % bits;
+			if (!(l.bits[b / 64] & ((uint64_t)1 << (b % 64))))
+				break;
+		}
+		if (i == FILTER_PROBES)
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Devices recently looked up and their postmarks, held within a memory budget
+// so the request path can skip the store for devices that keep coming back
+// without keeping every device there has ever been. Eviction is CLOCK: a hand
+// sweeps round the entries clearing each one's referenced bit and evicts the
+// first it finds already clear.
+//
+// Alongside is a Bloom filter of every device in the store, so a device that
+// has never been seen is answered without a lookup. The filter is only
+// trusted once it has been built from a full scan of the store, see
+// complete(). Devices are never taken out of it, so a released one costs a
+// lookup that finds nothing. It grows a layer at a time as devices are added
+// and needs no sizing. It comes out of the same budget, entries being evicted
+// to make room for it, and is dropped if it outgrows the budget by itself.
+class PmCache
+{
+public:
+	enum Found { Hit, Absent, Unknown }; // Unknown means ask the store
+
+	// In bytes, the filter included. 0 turns the cache off and forgets
+	// everything. A smaller budget evicts down to it
+	void budget(size_t bytes);
+	bool enabled() const;
+
+	Found get(const std::string& devId, uint32_t& pm);
+
+	// devId holds pm in the store, or is about to
+	void put(const std::string& devId, uint32_t pm);
+	void erase(const std::string& devId);
+
+	// Filter only, for every row of a full scan. Once done, complete()
+	void seen(const std::string& devId);
+	void complete();
+
+	void swap(PmCache& o);
+
+	struct Stats
+	{
+		size_t entries;
+		size_t bytes; // filterBytes included
+		size_t budget;
+		size_t filterBytes;
+		bool filterComplete;
+		uint64_t hits;
+		uint64_t misses; // went to the store
+		uint64_t filtered; // answered as never seen
+		uint64_t evictions;
+	};
+	Stats stats() const;
+
+private:
+	struct Slot
+	{
+		uint32_t pm;
+		bool referenced;
+		size_t pos; // in m_ring
+	};
+	typedef std::unordered_map<std::string, Slot> Map;
+
+	// One layer of the filter, at most capacity devices
+	struct Layer
+	{
+		std::vector<uint64_t> bits;
+		size_t capacity;
+		size_t count;
+	};
+
+	mutable std::mutex m_lk;
+	size_t m_budget = 0;
+	size_t m_bytes = 0;
+	Map m_map;
+	std::vector<Map::value_type*> m_ring; // the clock face. Map nodes never move
+	std::vector<size_t> m_free; // empty places on it
+	size_t m_hand = 0;
+
+	std::vector<Layer> m_filter;
+	size_t m_filterBytes = 0;
+	bool m_complete = false;
+	bool m_overBudget = false; // the filter was dropped, until the next clear()
+
+	uint64_t m_hits = 0;
+	uint64_t m_misses = 0;
+	uint64_t m_filtered = 0;
+	uint64_t m_evictions = 0;
+
+	static size_t cost(const std::string& devId);
+	void evict();
+	void remove(size_t pos);
+	void clear();
+
+	void addToFilter(const std::string& devId);
+	void dropFilter();
+	bool inFilter(const std::string& devId) const;
+};
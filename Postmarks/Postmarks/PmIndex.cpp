@@ -0,0 +1,109 @@
+#include "PmIndex.h"
+
+void PmIndex::set(const std::string& devId, uint32_t pm)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	if (!m_enabled)
+		return;
+
+	std::unordered_map<std::string, uint32_t>::iterator d = m_byDevice.find(devId);
+	if (d != m_byDevice.end())
+	{
+		if (d->second == pm)
+			return;
+		m_byPm.erase(d->second);
+	}
+
+	std::map<uint32_t, std::string>::iterator p = m_byPm.find(pm);
+	if (p != m_byPm.end())
+	{
+		m_byDevice.erase(p->second);
+		p->second = devId;
+	}
+	else
+		m_byPm.emplace(pm, devId);
+
+	m_byDevice[devId] = pm;
+}
+
+void PmIndex::erase(const std::string& devId)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	std::unordered_map<std::string, uint32_t>::iterator d = m_byDevice.find(devId);
+	if (d != m_byDevice.end())
+	{
+		m_byPm.erase(d->second);
+		m_byDevice.erase(d);
+	}
+}
+
+void PmIndex::swap(PmIndex& o)
+{
+	std::lock(m_lk, o.m_lk);
+	std::lock_guard<std::mutex> lk(m_lk, std::adopt_lock);
+	std::lock_guard<std::mutex> olk(o.m_lk, std::adopt_lock);
+
+	m_byDevice.swap(o.m_byDevice);
+	m_byPm.swap(o.m_byPm);
+	std::swap(m_enabled, o.m_enabled);
+}
+
+size_t PmIndex::size() const
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	return m_byDevice.size();
+}
+
+void PmIndex::enable(bool on)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	m_enabled = on;
+	if (!on)
+	{
+		m_byDevice.clear();
+		m_byPm.clear();
+	}
+}
+
+bool PmIndex::enabled() const
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	return m_enabled;
+}
+
+bool PmIndex::byDevice(const std::string& devId, uint32_t& pm) const
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	std::unordered_map<std::string, uint32_t>::const_iterator d = m_byDevice.find(devId);
+	if (d == m_byDevice.end())
+		return false;
+
+	pm = d->second;
+	return true;
+}
+
+bool PmIndex::byPm(uint32_t pm, std::string& devId) const
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	std::map<uint32_t, std::string>::const_iterator p = m_byPm.find(pm);
+	if (p == m_byPm.end())
+		return false;
+
+	devId = p->second;
+	return true;
+}
+
+bool PmIndex::range(uint32_t from, uint32_t to, size_t limit, Held& out) const
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+
+	std::map<uint32_t, std::string>::const_iterator p = m_byPm.lower_bound(from);
+	for (; p != m_byPm.end() && p->first <= to && limit; ++p, --limit)
+		out.push_back({ p->second, p->first });
+
+	return p != m_byPm.end() && p->first <= to;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Every assignment the allocator holds, both ways round, so lookups and
+// diagnostics can ask who has what without going near the db. Kept in step
+// with m_used by Postmarks under its own lock. Queries only take the index's
+// lock, briefly, so they never wait on allocation.
+//
+// It grows with every device there is, so where memory is bounded it is
+// turned off and the store is asked instead.
+class PmIndex
+{
+	mutable std::mutex m_lk;
+	std::unordered_map<std::string, uint32_t> m_byDevice;
+	std::map<uint32_t, std::string> m_byPm; // ordered for paging through a range
+	bool m_enabled = true;
+
+public:
+	typedef std::vector<std::pair<std::string, uint32_t> > Held;
+
+	// Like the store's upsert, replaces whatever held the device or the
+	// postmark before
+	void set(const std::string& devId, uint32_t pm);
+	void erase(const std::string& devId);
+	void swap(PmIndex& o);
+	size_t size() const;
+
+	// Off it forgets everything, and set() and erase() do nothing
+	void enable(bool on);
+	bool enabled() const;
+
+	bool byDevice(const std::string& devId, uint32_t& pm) const;
+	bool byPm(uint32_t pm, std::string& devId) const;
+
+	// Up to limit postmarks held in [from, to], lowest first. Returns whether
+	// more follow
+	bool range(uint32_t from, uint32_t to, size_t limit, Held& out) const;
+};
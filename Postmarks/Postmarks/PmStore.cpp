@@ -0,0 +1,33 @@
+#include "PmStore.h"
+#include "SqliteStore.h"
+#include "MemoryStore.h"
+#include "JournalStore.h"
+
+std::string PmStore::scheme(const std::string& location, std::string& rest)
+{
+	// Anything shorter than two characters before the colon is a drive letter
+	std::string::size_type colon = location.find(':');
+	if (colon == std::string::npos || colon < 2 || location.find_first_of("/\\") < colon)
+	{
+		rest = location;
+		return "sqlite";
+	}
+
+	rest = location.substr(colon + 1);
+	return location.substr(0, colon);
+}
+
+std::unique_ptr<PmStore> PmStore::create(const std::string& location, Logging::LogFile& log, const Options& opts)
+{
+	std::string rest;
+	std::string s = scheme(location, rest);
+
+	if (s == "memory")
+		return std::unique_ptr<PmStore>(new MemoryStore());
+	if (s == "journal")
+		return std::unique_ptr<PmStore>(new JournalStore(log));
+	if (s == "sqlite")
+		return std::unique_ptr<PmStore>(new SqliteStore(log, opts.keyByHash));
+
+	return nullptr;
+}
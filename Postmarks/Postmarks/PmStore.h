@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Logging/Log.h"
+
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Where postmark assignments are kept. Postmarks only ever talks to the store
+// through this, so the allocator and message path can be run against an
+// in-memory store with no disk I/O at all.
+//
+// get() is called from the request threads, load*() from reconfiguration and
+// the write side (begin() to commit()) only ever from the PmWriter thread.
+// Implementations have to cope with those overlapping.
+class PmStore
+{
+public:
+	// lastSeen is in seconds since the epoch, 0 if never recorded
+	typedef std::function<void(const std::string& devId, uint32_t pm, int64_t rangeId, bool tagged, int64_t lastSeen)> RowFn;
+
+	// Where a scan() has got to. A default one starts from the beginning
+	struct Cursor
+	{
+		bool started = false;
+		bool done = false;
+		int64_t pos = 0; // meaning is up to the store
+	};
+
+	// From the config. Each backend takes what applies to it
+	struct Options
+	{
+		bool keyByHash = false; // SQLite, see SqliteStore
+	};
+
+	virtual ~PmStore() {}
+
+	// The scheme of DbFile picks the backend:
+	//   memory:          nothing is persisted
+	//   journal:<path>   append-only journal and snapshot, see JournalStore
+	//   sqlite:<path>    or just <path>, a SQLite db file
+	static std::unique_ptr<PmStore> create(const std::string& location, Logging::LogFile& log, const Options& opts);
+	static std::unique_ptr<PmStore> create(const std::string& location, Logging::LogFile& log) { return create(location, log, Options()); }
+	static std::string scheme(const std::string& location, std::string& rest);
+
+	virtual bool open(const std::string& location) = 0;
+	virtual void close() = 0;
+
+	virtual bool get(const std::string& devId, uint32_t& pm) = 0;
+
+	// Up to limit devices holding postmarks in [from, to], lowest first.
+	// Returns whether more follow. For queries when there is no index
+	typedef std::vector<std::pair<std::string, uint32_t> > Held;
+	virtual bool held(uint32_t from, uint32_t to, size_t limit, Held& out) = 0;
+
+	// Every row, or only those with no range_id or one not in ranges
+	virtual bool loadAll(RowFn fn) = 0;
+	virtual bool loadUnknown(const std::set<int64_t>& ranges, RowFn fn) = 0;
+
+	// Every row a chunk at a time, for background work that must not hold
+	// anything for long. About limit rows per call, in an order of the store's
+	// choosing. Rows changed between calls may be missed or seen twice. fn
+	// must not call back into the store
+	virtual bool scan(Cursor& cursor, size_t limit, RowFn fn) = 0;
+
+	// Changes between begin() and commit() are applied as one batch. An
+	// upsert replaces whatever held the device or the postmark before
+	virtual bool begin() = 0;
+	virtual bool upsert(const std::string& devId, uint32_t pm, int64_t rangeId) = 0;
+	virtual bool remove(const std::string& devId) = 0;
+	virtual bool retag(const std::string& devId, uint32_t pm, int64_t rangeId) = 0;
+	virtual bool touch(const std::string& devId, int64_t lastSeen) = 0;
+	virtual bool commit() = 0;
+
+	// Online copy to path, a few pages at a time. Only ever called from the
+	// PmWriter thread between batches. Stores that can't do it return false
+	virtual bool backupStart(const std::string& /*path*/) { return false; }
+	virtual int backupStep(int /*pages*/) { return -1; } // pages left, 0 when done, <0 on failure
+	virtual void backupAbort() {}
+
+	// Housekeeping the store would rather not do inside a commit. Called from
+	// the PmWriter thread whenever its queue is empty. Returns whether there
+	// is more to do
+	virtual bool idle() { return false; }
+};
@@ -0,0 +1,195 @@
+#include "PmTransfer.h"
+
+#include <cstdlib>
+
+namespace
+{
+	const char MAGIC[] = "PMX1";
+	const size_t FLUSH_AT = 1 << 16;
+
+	void putLE(std::string& buf, uint64_t v, int bytes)
+	{
+		for (int i = 0; i < bytes; ++i)
+			buf.push_back((char)((v >> (i * 8)) & 0xff));
+	}
+
+	uint64_t getLE(const char* p, int bytes)
+	{
+		uint64_t v = 0;
+		for (int i = 0; i < bytes; ++i)
+			v |= (uint64_t)(uint8_t)p[i] << (i * 8);
+		return v;
+	}
+
+	bool parsePm(const std::string& s, uint32_t& pm)
+	{
+		char* end = nullptr;
+		unsigned long long v = std::strtoull(s.c_str(), &end, 10);
+		if (s.empty() || *end || v > 0xffffffffULL)
+			return false;
+		pm = (uint32_t)v;
+		return true;
+	}
+}
+
+namespace PmTransfer
+{
+	Format formatOf(const std::string& file)
+	{
+		std::string::size_type dot = file.rfind('.');
+		if (dot == std::string::npos)
+			return Binary;
+
+		std::string ext = file.substr(dot + 1);
+		for (char& c : ext)
+			c = (char)tolower((unsigned char)c);
+		return ext == "csv" ? Csv : Binary;
+	}
+
+	Writer::Writer(std::ostream& os, Format fmt)
+		: m_os(os)
+		, m_fmt(fmt)
+	{
+		if (m_fmt == Csv)
+			m_buf = "device,pm,range_id\n";
+		else
+			m_buf.append(MAGIC, 4);
+	}
+
+	Writer::~Writer()
+	{
+		flush();
+	}
+
+	void Writer::write(const std::string& devId, uint32_t pm, int64_t rangeId)
+	{
+		if (m_fmt == Csv)
+		{
+			if (devId.find_first_of(",\"\r\n") == std::string::npos)
+				m_buf += devId;
+			else
+			{
+				m_buf += '"';
+				for (char c : devId)
+				{
+					if (c == '"')
+						m_buf += '"';
+					m_buf += c;
+				}
+				m_buf += '"';
+			}
+			m_buf += ',';
+			m_buf += std::to_string(pm);
+			m_buf += ',';
+			m_buf += std::to_string(rangeId);
+			m_buf += '\n';
+		}
+		else
+		{
+			putLE(m_buf, pm, 4);
+			putLE(m_buf, (uint64_t)rangeId, 8);
+			putLE(m_buf, devId.size(), 2);
+			m_buf += devId;
+		}
+
+		if (m_buf.size() >= FLUSH_AT)
+			flush();
+	}
+
+	void Writer::flush()
+	{
+		m_os.write(m_buf.data(), m_buf.size());
+		m_buf.clear();
+	}
+
+	Reader::Reader(std::istream& is, Format fmt)
+		: m_is(is)
+		, m_fmt(fmt)
+	{
+		if (m_fmt == Binary)
+		{
+			char magic[4];
+			if (!m_is.read(magic, 4) || std::string(magic, 4) != MAGIC)
+				m_bad = true;
+		}
+	}
+
+	bool Reader::next(std::string& devId, uint32_t& pm)
+	{
+		if (m_bad)
+			return false;
+
+		bool ok = m_fmt == Csv ? nextCsv(devId, pm) : nextBinary(devId, pm);
+		if (ok)
+			++m_record;
+		return ok;
+	}
+
+	bool Reader::nextCsv(std::string& devId, uint32_t& pm)
+	{
+		while (std::getline(m_is, m_line))
+		{
+			if (!m_line.empty() && m_line.back() == '\r')
+				m_line.pop_back();
+			if (m_line.empty() || m_line.compare(0, 7, "device,") == 0)
+				continue;
+
+			// The device, quoted or not, then pm. Anything after that is ignored
+			size_t pos = 0;
+			devId.clear();
+			if (m_line[0] == '"')
+			{
+				for (pos = 1; pos < m_line.size(); ++pos)
+				{
+					if (m_line[pos] == '"')
+					{
+						if (pos + 1 < m_line.size() && m_line[pos + 1] == '"')
+							++pos;
+						else
+							break;
+					}
+					devId += m_line[pos];
+				}
+				++pos;
+			}
+			else
+			{
+				pos = m_line.find(',');
+				devId = m_line.substr(0, pos);
+			}
+
+			std::string::size_type end = pos < m_line.size() ? m_line.find(',', pos + 1) : std::string::npos;
+			if (pos >= m_line.size() || m_line[pos] != ',' || devId.empty()
+				|| !parsePm(m_line.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1), pm))
+			{
+				m_bad = true;
+				return false;
+			}
+
+			return true;
+		}
+
+		m_bad = !m_is.eof();
+		return false;
+	}
+
+	bool Reader::nextBinary(std::string& devId, uint32_t& pm)
+	{
+		char hdr[14];
+		if (!m_is.read(hdr, sizeof(hdr)))
+		{
+			// A clean end falls exactly on a record boundary
+			m_bad = m_is.gcount() != 0;
+			return false;
+		}
+
+		pm = (uint32_t)getLE(hdr, 4);
+		devId.resize(getLE(hdr + 12, 2));
+		if (devId.empty() || !m_is.read(&devId[0], devId.size()))
+		{
+			m_bad = true;
+			return false;
+		}
+		return true;
+	}
+}
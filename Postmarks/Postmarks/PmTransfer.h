@@ -0,0 +1,56 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Streams assignments to and from a file, one at a time, so the whole set
+// never has to be held as text.
+//
+//   Csv      device,pm,range_id with a header line. Devices are quoted when
+//            they need to be
+//   Binary   "PMX1" then per assignment: pm u32, range_id i64, device length
+//            u16 and the device. Little endian
+//
+// range_id is informational on import, it is recomputed from the config.
+namespace PmTransfer
+{
+	enum Format { Csv, Binary };
+
+	// .csv is Csv, anything else Binary
+	Format formatOf(const std::string& file);
+
+	class Writer
+	{
+		std::ostream& m_os;
+		Format m_fmt;
+		std::string m_buf;
+
+	public:
+		Writer(std::ostream& os, Format fmt);
+		~Writer();
+
+		void write(const std::string& devId, uint32_t pm, int64_t rangeId);
+		void flush();
+	};
+
+	class Reader
+	{
+		std::istream& m_is;
+		Format m_fmt;
+		size_t m_record = 0;
+		bool m_bad = false;
+		std::string m_line;
+
+		bool nextCsv(std::string& devId, uint32_t& pm);
+		bool nextBinary(std::string& devId, uint32_t& pm);
+
+	public:
+		Reader(std::istream& is, Format fmt);
+
+		// false at the end or on a malformed record, which bad() then says
+		bool next(std::string& devId, uint32_t& pm);
+		bool bad() const { return m_bad; }
+		size_t record() const { return m_record; }
+	};
+}
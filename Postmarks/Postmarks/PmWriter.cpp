@@ -0,0 +1,252 @@
+#include "PmWriter.h"
+#include "Postmarks.h"
+
+#include <algorithm>
+
+PmWriter::PmWriter(Logging::LogFile& log, CommitFn onCommit)
+	: Logging::LogClient(log)
+	, m_onCommit(onCommit)
+	, m_q(MAX_BATCH)
+{
+}
+
+PmWriter::~PmWriter()
+{
+	close();
+}
+
+bool PmWriter::open(PmStore& store)
+{
+	if (m_run && &store == m_store)
+		return true;
+
+	// Drains anything still queued for the old store first
+	close();
+
+	m_store = &store;
+	m_run = true;
+	m_thread = std::thread(&PmWriter::run, this);
+
+	return true;
+}
+
+void PmWriter::close()
+{
+	if (m_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_wakeLk);
+			m_run = false;
+		}
+		m_wake.notify_one();
+		m_thread.join();
+	}
+
+	if (m_backingUp)
+		m_store->backupAbort();
+	m_backingUp = false;
+	m_store = nullptr;
+}
+
+void PmWriter::push(Record::Op op, const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	enqueue(new Record{ op, devId, pm, rangeId, std::chrono::steady_clock::now(), nullptr });
+}
+
+void PmWriter::push(const std::shared_ptr<Release>& release)
+{
+	// A single record, so however many devices it holds they are never split
+	// across batches
+	enqueue(new Record{ Record::Release, release->reqId, 0, 0, std::chrono::steady_clock::now(), release });
+}
+
+void PmWriter::enqueue(Record* r)
+{
+	// Count first so the writer never sees more records than m_depth says
+	m_depth.fetch_add(1);
+	m_q.push(r);
+
+	if (m_sleeping)
+	{
+		std::lock_guard<std::mutex> lk(m_wakeLk);
+		m_wake.notify_one();
+	}
+}
+
+void PmWriter::backup(const std::string& path, int pagesPerStep, std::chrono::seconds interval)
+{
+	{
+		std::lock_guard<std::mutex> lk(m_wakeLk);
+
+		// Reapplying the same settings keeps the schedule
+		if (path == m_backupPath && pagesPerStep == m_backupPages && interval == m_backupInterval)
+			return;
+
+		m_backupPath = path;
+		m_backupPages = pagesPerStep;
+		m_backupInterval = interval;
+		m_nextBackup = std::chrono::steady_clock::now();
+	}
+	m_wake.notify_one();
+}
+
+PmWriter::Stats PmWriter::stats() const
+{
+	return Stats{ m_depth, m_records, m_batches, m_failures,
+		std::chrono::microseconds(m_lastCommit), std::chrono::microseconds(m_maxCommit), std::chrono::microseconds(m_totalCommit),
+		std::chrono::microseconds(m_maxLatency), m_backups, m_backupFailures };
+}
+
+void PmWriter::run()
+{
+	std::vector<Record*> batch;
+	batch.reserve(MAX_BATCH);
+	std::vector<bool> written;
+
+	while (true)
+	{
+		Record* r;
+		while (batch.size() < MAX_BATCH && m_q.pop(r))
+			batch.push_back(r);
+
+		if (batch.empty())
+		{
+			// Drain everything before stopping
+			if (!m_run)
+				break;
+
+			// Checks the queue again after every step, so a backup only ever
+			// delays a batch by one step
+			if (backupStep() || m_store->idle())
+				continue;
+
+			m_sleeping = true;
+			{
+				std::unique_lock<std::mutex> lk(m_wakeLk);
+				auto ready = [this]() { return m_depth > 0 || !m_run; };
+				if (m_backupPath.empty())
+					m_wake.wait(lk, ready);
+				else
+					m_wake.wait_until(lk, m_nextBackup, ready);
+			}
+			m_sleeping = false;
+			continue;
+		}
+
+		commit(batch, written);
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			m_onCommit(*batch[i], written[i]);
+			delete batch[i];
+		}
+
+		m_depth -= batch.size();
+		batch.clear();
+	}
+}
+
+void PmWriter::commit(const std::vector<Record*>& batch, std::vector<bool>& written)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	written.assign(batch.size(), false);
+	bool ok = m_store->begin();
+	for (size_t i = 0; ok && i < batch.size(); ++i)
+	{
+		const Record* r = batch[i];
+		switch (r->op)
+		{
+		case Record::Upsert:
+			written[i] = m_store->upsert(r->devId, r->pm, r->rangeId);
+			break;
+		case Record::Delete:
+			written[i] = m_store->remove(r->devId);
+			break;
+		case Record::Retag:
+			written[i] = m_store->retag(r->devId, r->pm, r->rangeId);
+			break;
+		case Record::Touch:
+			written[i] = m_store->touch(r->devId, r->rangeId);
+			break;
+		case Record::Release:
+			written[i] = true;
+			for (const std::pair<std::string, uint32_t>& d : r->release->released)
+				written[i] = m_store->remove(d.first) && written[i];
+			break;
+		}
+	}
+
+	// Nothing in the batch is written unless the transaction is
+	if (!(ok && m_store->commit()))
+		written.assign(batch.size(), false);
+	m_failures += std::count(written.begin(), written.end(), false);
+
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	m_lastCommit = us;
+	m_totalCommit += us;
+	if (us > m_maxCommit)
+		m_maxCommit = us;
+
+	// The batch is in queue order so the first record waited longest
+	int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(end - batch.front()->queued).count();
+	if (latency > m_maxLatency)
+		m_maxLatency = latency;
+	m_records += batch.size();
+	++m_batches;
+
+	LOG(Logging::LL_Debug, Logging::LC_Postmarks, "Committed " << batch.size() << " postmarks in " << us << "us, " << m_depth - batch.size() << " still queued");
+}
+
+bool PmWriter::backupStep()
+{
+	std::string path;
+	int pages;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lk(m_wakeLk);
+
+		if (m_backupPath.empty() || (!m_backingUp && now < m_nextBackup))
+		{
+			if (m_backingUp && m_backupPath.empty())
+			{
+				m_store->backupAbort();
+				m_backingUp = false;
+			}
+			return false;
+		}
+
+		path = m_backupPath;
+		pages = m_backupPages > 0 ? m_backupPages : -1;
+		if (!m_backingUp)
+			m_nextBackup = now + m_backupInterval;
+	}
+
+	if (!m_backingUp)
+	{
+		if (!m_store->backupStart(path))
+		{
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't back up to " << path);
+			++m_backupFailures;
+			return false;
+		}
+		m_backingUp = true;
+		m_backupStarted = now;
+	}
+
+	int left = m_store->backupStep(pages);
+	if (left > 0)
+		return true;
+
+	m_backingUp = false;
+	if (left < 0)
+	{
+		++m_backupFailures;
+		return false;
+	}
+
+	++m_backups;
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Backed up to " << path << " in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_backupStarted).count() << "ms");
+	return true;
+}
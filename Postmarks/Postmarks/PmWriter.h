@@ -0,0 +1,121 @@
+#pragma once
+
+#include "Logging/Log.h"
+#include "PmStore.h"
+
+#include <boost/lockfree/queue.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes postmark assignments to the store on a thread of its own so that a
+// commit never holds up allocation. Records are queued lock free, written in
+// batches of one transaction each, and handed back through the commit callback
+// once that transaction is durable. Whenever the queue is empty the writer
+// also advances any scheduled backup of the store, a few pages at a time, and
+// lets the store do its own housekeeping.
+class PmWriter : public Logging::LogClient
+{
+public:
+	// Devices released by one request. Written in one transaction and
+	// acknowledged together
+	struct Release
+	{
+		std::string reqId;
+		std::vector<std::pair<std::string, uint32_t> > released;
+		std::vector<std::string> unknown;
+		bool failed = false;
+		bool expired = false; // reclaimed by the service itself, not on request
+	};
+
+	struct Record
+	{
+		enum Op { Upsert, Delete, Retag, Release, Touch }; // Touch keeps the time last seen in rangeId
+
+		Op op;
+		std::string devId;
+		uint32_t pm;
+		int64_t rangeId;
+		std::chrono::steady_clock::time_point queued;
+		std::shared_ptr<PmWriter::Release> release; // Release only
+	};
+
+	// Called for every record with whether that record itself was written. A
+	// batch can be partly written, one record failing leaves the rest be
+	typedef std::function<void(const Record&, bool)> CommitFn; // record, written ok
+
+	struct Stats
+	{
+		size_t depth; // queued and not yet committed
+		uint64_t records;
+		uint64_t batches;
+		uint64_t failures;
+		std::chrono::microseconds lastCommit;
+		std::chrono::microseconds maxCommit;
+		std::chrono::microseconds totalCommit;
+		std::chrono::microseconds maxLatency; // queued to durable
+		uint64_t backups;
+		uint64_t backupFailures;
+	};
+
+	PmWriter(Logging::LogFile& log, CommitFn onCommit);
+	~PmWriter();
+
+	bool open(PmStore& store);
+	void close();
+
+	void push(Record::Op op, const std::string& devId, uint32_t pm, int64_t rangeId = 0);
+	void push(const std::shared_ptr<Release>& release);
+
+	// Back up to path every interval, pagesPerStep pages at a time. An empty
+	// path turns it off
+	void backup(const std::string& path, int pagesPerStep, std::chrono::seconds interval);
+
+	Stats stats() const;
+
+private:
+	static const size_t MAX_BATCH = 512;
+
+	CommitFn m_onCommit;
+	PmStore* m_store = nullptr;
+
+	boost::lockfree::queue<Record*> m_q;
+	std::thread m_thread;
+	std::atomic<bool> m_run{false};
+
+	// The writer sleeps when the queue is empty. Producers only take the lock
+	// to wake it, and only when it is actually asleep
+	std::atomic<size_t> m_depth{0};
+	std::atomic<bool> m_sleeping{false};
+	std::mutex m_wakeLk;
+	std::condition_variable m_wake;
+
+	std::atomic<uint64_t> m_records{0};
+	std::atomic<uint64_t> m_batches{0};
+	std::atomic<uint64_t> m_failures{0};
+	std::atomic<int64_t> m_lastCommit{0};
+	std::atomic<int64_t> m_maxCommit{0};
+	std::atomic<int64_t> m_totalCommit{0};
+	std::atomic<int64_t> m_maxLatency{0};
+
+	// Set under m_wakeLk. m_backingUp is only touched by the writer thread
+	std::string m_backupPath;
+	int m_backupPages = 0;
+	std::chrono::seconds m_backupInterval{0};
+	std::chrono::steady_clock::time_point m_nextBackup;
+	bool m_backingUp = false;
+	std::chrono::steady_clock::time_point m_backupStarted;
+	std::atomic<uint64_t> m_backups{0};
+	std::atomic<uint64_t> m_backupFailures{0};
+
+	void enqueue(Record* r);
+	void run();
+	void commit(const std::vector<Record*>& batch, std::vector<bool>& written);
+	bool backupStep();
+};
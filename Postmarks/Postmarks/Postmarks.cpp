@@ -1,7 +1,10 @@
 #include "configuration-pimpl.hxx"
 #include "postmark-pimpl.hxx"
 #include "postmark-simpl.hxx"
+#include "postmarkAdmin-pimpl.hxx"
+#include "postmarkAdmin-simpl.hxx"
 #include "Postmarks.h"
+#include "PmTransfer.h"
 
 #include <stdint.h>
 #include <boost/asio.hpp>
@@ -10,10 +13,18 @@
 #include <sstream>
 #include <fstream>
 #include <chrono>
+#include <unordered_set>
 
 const PubSub::Subject SUB_CFG{ "CFG", "Postmarks" };
 const PubSub::Subject SUB_PMREQ{ "_", "Postmark", "Request" };
 const PubSub::Subject PUB_PMRSP{ "Postmark", "Response" };
+const PubSub::Subject SUB_PMREL{ "_", "Postmark", "Release" };
+const PubSub::Subject PUB_PMRELRSP{ "Postmark", "Released" };
+const PubSub::Subject SUB_PMQRY{ "_", "Postmark", "Query" };
+const PubSub::Subject PUB_PMQRYRSP{ "Postmark", "QueryResult" };
+
+const PubSub::Subject SUB_STATS{ "Stats", "Postmarks" };
+const PubSub::Subject PUB_STATUS{ "Status", "Postmarks" };
 
 #if defined(_DEBUG)
 const PubSub::Subject SUB_DIE{ "Die", "Postmarks"};
@@ -22,10 +33,41 @@ const PubSub::Subject SUB_DIE{ "Die", "Postmarks"};
 constexpr qpc_clock::duration TTL_LONGTIME{std::chrono::hours(-12)}; // up to 12 hrs or until superseded
 constexpr qpc_clock::duration TTL_STATUS{std::chrono::minutes(1)};
 
-Postmarks::Postmarks(Logging::LogFile& log, const std::string& psubAddr)
-	: Task::TActiveTask<Postmarks>(2)
+constexpr int BACKUP_PAGES = 64;
+constexpr std::chrono::seconds BACKUP_INTERVAL{std::chrono::hours(1)};
+
+constexpr int64_t STATUS_INTERVAL = 60; // seconds
+
+constexpr int64_t LATENCY_DUMP = 300; // seconds between logging stage latencies
+const char* const STAGE_NAMES[] = { "queue", "parse", "lock", "lookup", "match", "store", "write", "serialize", "publish" }; // in Stage order
+
+// The request the current dispatcher thread is handling
+static thread_local TraceRing::Entry t_trace;
+
+// The subscriptions a recording can hold, indexed by the kind stored
+const PubSub::Subject* const RECORDED[] = { nullptr, &SUB_CFG, &SUB_PMREQ, &SUB_PMREL, &SUB_PMQRY, &SUB_STATS };
+constexpr uint8_t RECORDED_CFG = 1;
+constexpr int REPLAY_WINDOW = 1024; // most replayed messages queued at once when not paced
+
+constexpr size_t CACHE_BUDGET = 16384; // KB for recent lookups when Cache gives no budget
+
+constexpr size_t QUERY_LIMIT = 1000; // most held postmarks in one page of a range
+
+constexpr size_t LEASE_BATCH = 256; // expired postmarks reclaimed per tick at most
+constexpr int64_t SEEN_FLUSH = 60; // seconds between writing out last seen times
+
+constexpr size_t SWEEP_CHUNK = 256;
+constexpr double SWEEP_RATE = 50; // reclaimed a second
+constexpr int64_t SWEEP_PAUSE = 3600; // seconds from the end of one pass to the start of the next
+
+Postmarks::Postmarks(Logging::LogFile& log, const std::string& psubAddr, int workers)
+	: Task::TActiveTask<Postmarks>(workers)
 	, Logging::LogClient(log)
 	, m_hub(*this, psubAddr)
+	, m_log(log)
+	, m_writer(log, [this](const PmWriter::Record& r, bool ok) { postmarkWritten(r, ok); })
+	, m_expiry(epochNow())
+	, m_statusAt(std::chrono::steady_clock::now())
 {
 }
 
@@ -34,14 +76,22 @@ Postmarks::~Postmarks()
 	stop();
 }
 
-bool Postmarks::start()
+bool Postmarks::start(bool connect)
 {
 	LOG(Logging::LL_Debug, Logging::LC_Postmarks, "start");
 
 	if (!getMsgDispatcher().started())
 		getMsgDispatcher().start();
 
-	m_hub.start();
+	m_connect = connect;
+	if (connect)
+		m_hub.start();
+
+	if (!m_ticker.joinable())
+	{
+		m_ticking = true;
+		m_ticker = std::thread(&Postmarks::tickerRun, this);
+	}
 
 	return true;
 }
@@ -50,10 +100,40 @@ void Postmarks::stop()
 {
 	LOG(Logging::LL_Debug, Logging::LC_Postmarks, "stop");
 
-	m_hub.stop();
+	if (m_ticker.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lk(m_tickLk);
+			m_ticking = false;
+		}
+		m_tickCv.notify_one();
+		m_ticker.join();
+	}
+
+	if (m_connect)
+		m_hub.stop();
+
+	if (m_recorder.isOpen())
+	{
+		m_recorder.close();
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Recorded " << m_recorder.count() << " messages");
+	}
 
 	while (getMsgDispatcher().started())
 		getMsgDispatcher().stop();
+
+	// Last seen times not yet written would otherwise wait for the next start
+	{
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+		flushSeen();
+	}
+
+	PmWriter::Stats st = m_writer.stats();
+	m_writer.close();
+	dumpLatency(false);
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Writer committed " << st.records << " records in " << st.batches << " batches, "
+		<< st.failures << " failed, max commit " << st.maxCommit.count() << "us, " << st.backups << " backups, " << st.backupFailures << " failed");
 }
 
 void Postmarks::eventBusConnected(HubApps::HubConnectionState state)
@@ -62,13 +142,194 @@ void Postmarks::eventBusConnected(HubApps::HubConnectionState state)
 	{
 		m_hub.subscribe(SUB_CFG);
 		m_hub.subscribe(SUB_PMREQ);
+		m_hub.subscribe(SUB_PMREL);
+		m_hub.subscribe(SUB_PMQRY);
+		m_hub.subscribe(SUB_STATS);
 #if defined(_DEBUG)
 		m_hub.subscribe(SUB_DIE);
 #endif
 	}
 }
 
-void Postmarks::configure(const std::string& cfgStr)
+int64_t Postmarks::rangeId(const PmConfig::Range& r)
+{
+	return rangeId(r.regex(), r.from(), r.to());
+}
+
+int64_t Postmarks::rangeId(const std::string& regex, uint32_t from, uint32_t to)
+{
+	// FNV-1a over everything that decides which devices and numbers the range
+	// covers. This is persisted so must not change between releases
+	uint64_t h = 14695981039346656037ULL;
+	auto mix = [&h](uint8_t b) { h ^= b; h *= 1099511628211ULL; };
+
+	for (char c : regex)
+		mix(c);
+	mix(0);
+	for (int i = 0; i < 32; i += 8)
+		mix((from >> i) & 0xff);
+	for (int i = 0; i < 32; i += 8)
+		mix((to >> i) & 0xff);
+
+	return (int64_t)h;
+}
+
+void Postmarks::buildRanges(const PmConfig::Postmarks& cfg, regex_pm_t& postmarks)
+{
+	postmarks.clear();
+
+	for (const PmConfig::Range& r : cfg.range())
+		postmarks.push_back({ std::regex(r.regex()), Postmarks_t::View(m_used, Postmarks_t::NumericRange(r.from(), r.to())), rangeId(r) });
+}
+
+size_t Postmarks::matchRange(const regex_pm_t& postmarks, const std::string& devId, uint32_t pm)
+{
+	for (size_t i = 0; i < postmarks.size(); ++i)
+		if (postmarks[i].postmarks.inBounds(pm) && std::regex_match(devId, postmarks[i].regex))
+			return i;
+	return postmarks.size();
+}
+
+void Postmarks::reconcile(const regex_pm_t& postmarks, const std::string& devId, uint32_t pm, PmReload& reload)
+{
+	size_t idx = matchRange(postmarks, devId, pm);
+	if (idx < postmarks.size())
+		reload.retag.push_back({ devId, pm, postmarks[idx].id });
+	else
+		reload.rejected[devId] = pm; // record failed to pass current config rules
+}
+
+PmStore::Options Postmarks::storeOptions(const PmConfig::Postmarks& cfg)
+{
+	PmStore::Options opts;
+	opts.keyByHash = cfg.Sqlite_present() && cfg.Sqlite().keyByHash_present() && cfg.Sqlite().keyByHash();
+	return opts;
+}
+
+size_t Postmarks::cacheBudget(const PmConfig::Postmarks& cfg)
+{
+	if (!cfg.Cache_present())
+		return 0;
+	return (size_t)(cfg.Cache().budget_present() ? cfg.Cache().budget() : CACHE_BUDGET) * 1024;
+}
+
+bool Postmarks::loadPostmarks(PmStore& store, const regex_pm_t& postmarks, Postmarks_t* used, PmIndex* index, PmCache* cache, PmReload& reload, StartupTimes* times)
+{
+	std::set<int64_t> ids;
+	for (const PmRange& r : postmarks)
+		ids.insert(r.id);
+
+	// Charges the time since the last lap to one phase
+	std::chrono::steady_clock::time_point mark = std::chrono::steady_clock::now();
+	auto lap = [&](std::chrono::steady_clock::duration StartupTimes::* phase)
+	{
+		if (!times)
+			return;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		times->*phase += now - mark;
+		mark = now;
+	};
+
+	auto row = [&](const std::string& devId, uint32_t pm, int64_t rangeId, bool tagged, int64_t)
+	{
+		lap(&StartupTimes::scan);
+		if (times)
+			++times->rows;
+		if (cache)
+			cache->seen(devId);
+
+		// Rows recorded against a range that is still configured stay where
+		// they are. They only need reading when building the occupancy from
+		// scratch
+		if (tagged && ids.count(rangeId))
+		{
+			if (used)
+				used->addNum(pm);
+			if (index)
+				index->set(devId, pm);
+			lap(&StartupTimes::rebuild);
+			return;
+		}
+
+		reconcile(postmarks, devId, pm, reload);
+		lap(&StartupTimes::classify);
+		if (!reload.rejected.count(devId))
+		{
+			if (used)
+				used->addNum(pm);
+			if (index)
+				index->set(devId, pm);
+		}
+		lap(&StartupTimes::rebuild);
+	};
+
+	// Otherwise only rows that are not, or no longer, recorded against a
+	// configured range need the regexes run over them
+	bool ok = used || index ? store.loadAll(row) : store.loadUnknown(ids, row);
+	lap(&StartupTimes::scan);
+	if (ok && used && cache)
+		cache->complete();
+	return ok;
+}
+
+void Postmarks::commitReload(const PmReload& reload)
+{
+	// Queued behind any assignment already waiting, so a purge can't be undone
+	// by an older write landing after it
+	for (const PmTag& t : reload.retag)
+		m_writer.push(PmWriter::Record::Retag, t.devId, t.pm, t.rangeId);
+
+	for (const std::pair<const std::string, uint32_t>& r : reload.rejected)
+		m_writer.push(PmWriter::Record::Delete, r.first, r.second);
+
+	if (!reload.rejected.empty() || !reload.retag.empty())
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Retagging " << reload.retag.size() << " postmarks, discarding " << reload.rejected.size() << " not matching the current config");
+}
+
+void Postmarks::replayChange(const regex_pm_t& postmarks, const std::set<int64_t>& ids, const PmChange& c, PmReload& reload)
+{
+	reload.rejected.erase(c.devId);
+
+	// A device assigned from a range that has gone may fit no range now, and
+	// then it goes the same way as any other rejected row
+	if (c.newPm != Postmarks_t::MAX_N && !ids.count(c.rangeId))
+		reconcile(postmarks, c.devId, c.newPm, reload);
+	bool rejected = reload.rejected.count(c.devId) > 0;
+
+	uint32_t held;
+	bool holds = lookup(c.devId, held);
+	if (c.newPm == Postmarks_t::MAX_N || rejected)
+	{
+		if (!holds)
+			return;
+		unassign(c.devId, held);
+		if (!rejected)
+		{
+			m_unwritten[c.devId] = { Postmarks_t::MAX_N, 0 };
+			m_writer.push(PmWriter::Record::Delete, c.devId, 0);
+		}
+		return;
+	}
+
+	if (holds && held == c.newPm)
+		return;
+
+	if (m_used.contains(c.newPm))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Postmark " << c.newPm << " given to " << c.devId << " during the reload is already held in the new db. Left as it is");
+		return;
+	}
+
+	if (holds)
+		m_used.removeNum(held);
+	m_used.addNum(c.newPm);
+	m_index.set(c.devId, c.newPm);
+	m_cache.put(c.devId, c.newPm);
+	m_unwritten[c.devId] = { c.newPm, c.rangeId };
+	m_writer.push(PmWriter::Record::Upsert, c.devId, c.newPm, c.rangeId);
+}
+
+std::unique_ptr<PmConfig::Postmarks> Postmarks::parseConfig(const std::string& cfgStr)
 {
 	PmConfig::Postmarks_paggr s;
 	xml_schema::document_pimpl d(s.root_parser(), s.root_name());
@@ -76,104 +337,240 @@ void Postmarks::configure(const std::string& cfgStr)
 	std::istringstream cfgstrm(cfgStr);
 
 	s.pre();
+	d.parse(cfgstrm);
+
+	return std::unique_ptr<PmConfig::Postmarks>{s.post()};
+}
 
+void Postmarks::configure(const std::string& cfgStr, StartupTimes* times)
+{
 	try
 	{
-		if (!haveCfg)
-		{
-			d.parse(cfgstrm);
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		std::unique_ptr<PmConfig::Postmarks> cfg = parseConfig(cfgStr);
 
-			std::unique_lock<std::recursive_mutex> sync(m_lk);
+		// Only one reconfiguration at a time. Everything up to the swap is done
+		// without m_lk so requests continue to be served from the old ranges
+		std::unique_lock<std::mutex> cfgSync(m_cfgLk);
 
-			std::unique_ptr<PmConfig::Postmarks>{s.post()}->_copy(m_cfg);
+		regex_pm_t postmarks;
+		buildRanges(*cfg, postmarks);
+		if (times)
+			times->parse = std::chrono::steady_clock::now() - t;
 
-			m_postmarks.clear();
+		std::map<int64_t, int64_t> leases;
+		for (const PmConfig::Range& r : cfg->range())
+			if (r.lease_present() && r.lease() > 0)
+				leases[rangeId(r)] = r.lease();
 
-			for (const PmConfig::Range& r : m_cfg.range())
+		std::unique_ptr<PmStore> store;
+		bool sameDb = haveCfg && cfg->DbFile() == m_cfg.DbFile();
+		t = std::chrono::steady_clock::now();
+		if (!sameDb)
+		{
+			store = PmStore::create(cfg->DbFile(), m_log, storeOptions(*cfg));
+			if (!store)
 			{
-				m_postmarks.push_back({ std::regex(r.regex()), Postmarks_t() });
-				Postmarks_t::NumericRangeList rangelist;
+				LOG(Logging::LL_Warning, Logging::LC_Postmarks, "CONFIG ERROR: Unknown store " << cfg->DbFile());
+				return;
+			}
+			if (!store->open(cfg->DbFile()))
+				return;
+		}
+		if (times)
+			times->open = std::chrono::steady_clock::now() - t;
 
-				rangelist += Postmarks_t::NumericRange(r.from(), r.to());
-				for (const Postmarks_t::NumericRange& n : rangelist.getRangeSet())
-					m_postmarks.back().second += n;
+		// All ranges share m_used, so a range that is still configured keeps its
+		// postmarks as they are wherever it now sits in the list. Only devices
+		// recorded against a range that has gone (or been resized, which gives
+		// it a new id) need reconciling
+		std::set<int64_t> ids;
+		for (const PmRange& r : postmarks)
+			ids.insert(r.id);
+
+		size_t removed = 0;
+		if (sameDb)
+			for (const PmRange& r : m_postmarks)
+				removed += ids.count(r.id) ? 0 : 1;
+
+		// Without a cache budget every device is kept in m_index. Turned on
+		// against the same db it is filled by a full scan
+		bool indexed = !cacheBudget(*cfg);
+		bool buildIndex = indexed && (!sameDb || !m_index.enabled());
+
+		bool rescan = !sameDb || removed || buildIndex;
+		if (rescan)
+		{
+			std::unique_lock<std::recursive_mutex> sync(m_lk);
+			m_reconfiguring = true;
+			m_cfgChanges.clear();
+		}
+
+		// A different db means building the occupancy from scratch
+		Postmarks_t used;
+		PmIndex index;
+		PmCache cache;
+		PmReload reload;
+		bool leasesChanged = false;
+		index.enable(indexed);
+		if (!sameDb)
+			cache.budget(cacheBudget(*cfg));
+		bool loaded = !rescan || loadPostmarks(sameDb ? *m_store : *store, postmarks, sameDb ? nullptr : &used, buildIndex ? &index : nullptr,
+			sameDb ? nullptr : &cache, reload, times);
+
+		{
+			// The writer keeps to the old store until the swap and only moves
+			// once everything queued for it is written. Its callbacks take m_lk,
+			// so it drains without the lock. Nothing is queued without m_lk, so
+			// empty once holding it means it stays empty
+			std::unique_lock<std::recursive_mutex> sync(m_lk, std::defer_lock);
+			while (true)
+			{
+				while (store && loaded && m_writer.stats().depth > 0)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				sync.lock();
+				if (!store || !loaded || m_writer.stats().depth == 0)
+					break;
+				sync.unlock();
 			}
 
-			//int rc = sqlite3_open_v2(m_cfg.DbFile().c_str(), &m_pmdb, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
-			int rc = sqlite3_open(m_cfg.DbFile().c_str(), &m_pmdb);
-			if (rc)
+			m_reconfiguring = false;
+			if (!loaded)
 			{
-				LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open database: " << sqlite3_errmsg(m_pmdb));
-				sqlite3_close(m_pmdb);
+				m_cfgChanges.clear();
 				return;
 			}
 
-			char* err = nullptr;
-			rc = sqlite3_exec(m_pmdb, "CREATE TABLE IF NOT EXISTS postmarks (pm INTEGER PRIMARY KEY, device TEXT UNIQUE)", nullptr, nullptr, &err);
-			if (rc)
+			// Catch up with anything assigned since the snapshot was taken. On
+			// the same db m_used is live and already has the change
+			if (sameDb)
 			{
-				LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error creating tables: " << err);
-				sqlite3_free(err);
-			}
+				for (const PmChange& c : m_cfgChanges)
+				{
+					reload.rejected.erase(c.devId);
+					if (c.newPm != Postmarks_t::MAX_N && !ids.count(c.rangeId))
+						reconcile(postmarks, c.devId, c.newPm, reload);
+				}
 
-			sqlite3_stmt* stmt;
-			sqlite3_prepare_v2(m_pmdb, "SELECT * FROM Postmarks", 24, &stmt, nullptr);
+				// and anything that was still queued when the snapshot was taken
+				for (const std::pair<const std::string, std::pair<uint32_t, int64_t> >& u : m_unwritten)
+				{
+					reload.rejected.erase(u.first);
+					if (u.second.first == Postmarks_t::MAX_N)
+						continue; // released
+					if (!ids.count(u.second.second))
+						reconcile(postmarks, u.first, u.second.first, reload);
+				}
 
-			bool done = false;
-			while (!done)
-			{
-				switch (sqlite3_step(stmt))
+				// A new index missed whatever changed while it was filled
+				if (buildIndex)
 				{
-				case SQLITE_ROW:
+					for (const PmChange& c : m_cfgChanges)
 					{
-						uint32_t assigned = Postmarks_t::MAX_N;
-
-						for (regex_pm_t::value_type& v : m_postmarks)
-						{
-							if (!v.second.full())
-							{
-								if (assigned != Postmarks_t::MAX_N)
-								{
-									v.second.addNum(assigned);
-									continue;
-								}
-
-								if (std::regex_match((const char*)sqlite3_column_text(stmt, 1), v.first))
-								{
-									if (v.second.addNum(sqlite3_column_int(stmt, 0)))
-										assigned = sqlite3_column_int(stmt, 0);
-								}
-							}
-						}
-
-						if (assigned == Postmarks_t::MAX_N)
-						{
-							// record failed to pass current config rules
-							// discard and publish
-							std::stringstream sql;
-							sql << "DELETE FROM Postmarks WHERE device = '" << (const char*)sqlite3_column_text(stmt, 1) << "'";
-							sqlite3_exec(m_pmdb, sql.str().c_str(), nullptr, nullptr, nullptr);
-
-							postmarks::pmRsp r;
-							r.devId((const char*)sqlite3_column_text(stmt, 1));
-							r.pm_present(false);
-							enqueue(r);
-						}
+						if (c.newPm == Postmarks_t::MAX_N)
+							index.erase(c.devId);
+						else
+							index.set(c.devId, c.newPm);
 					}
-					break;
-				case SQLITE_DONE:
-					done = true;
-					break;
-				default:
-					LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error creating reading postmarks");
-					break;
+					for (const std::pair<const std::string, std::pair<uint32_t, int64_t> >& u : m_unwritten)
+					{
+						if (u.second.first == Postmarks_t::MAX_N)
+							index.erase(u.first);
+						else
+							index.set(u.first, u.second.first);
+					}
+					m_index.swap(index);
+				}
+				else if (!indexed)
+					m_index.enable(false);
+
+				for (const std::pair<const std::string, uint32_t>& r : reload.rejected)
+				{
+					m_used.removeNum(r.second);
+					m_index.erase(r.first);
+					m_cache.erase(r.first);
+				}
+
+				// Turned on here the filter is empty, so every miss goes to the
+				// store until the next full load
+				m_cache.budget(cacheBudget(*cfg));
+			}
+			else
+			{
+				if (!m_writer.open(*store))
+				{
+					m_cfgChanges.clear();
+					return;
 				}
+
+				m_used.swap(used);
+				m_index.swap(index);
+				m_cache.swap(cache);
+				m_store.swap(store);
+				m_unwritten.clear();
+				m_seen.clear();
+				m_seenFlushed.clear();
+
+				// Anything assigned or released while the scan ran went to the
+				// old store. It is carried over to the new one in the order it
+				// happened
+				for (const PmChange& c : m_cfgChanges)
+					replayChange(postmarks, ids, c, reload);
 			}
+			m_cfgChanges.clear();
+
+			// Rejected postmarks are free from here on, so until the Delete is
+			// written the device must read as released and not from the store
+			for (const std::pair<const std::string, uint32_t>& r : reload.rejected)
+				m_unwritten[r.first] = { Postmarks_t::MAX_N, 0 };
+
+			m_postmarks.swap(postmarks);
+			leasesChanged = leases != m_leaseCfg;
+			m_leaseCfg.swap(leases);
+			cfg->_copy(m_cfg);
 
-			sqlite3_finalize(stmt);
+			m_statusInterval = m_cfg.StatusInterval_present() ? m_cfg.StatusInterval() : STATUS_INTERVAL;
+
+			m_sweepAge = m_cfg.Sweep_present() ? std::max<int64_t>(m_cfg.Sweep().maxAge(), 1) : 0;
+			if (m_sweepAge)
+			{
+				m_sweepChunk = m_cfg.Sweep().chunk_present() ? std::max<size_t>(m_cfg.Sweep().chunk(), 1) : SWEEP_CHUNK;
+				m_sweepRate = m_cfg.Sweep().rate_present() ? std::max<double>(m_cfg.Sweep().rate(), 1) : SWEEP_RATE;
+			}
 
 			haveCfg = true;
+
+			// Queued before the lock is let go, so a rejected device that asks
+			// again straight away has its new postmark written after the Delete
+			t = std::chrono::steady_clock::now();
+			commitReload(reload);
 		}
+
+		if (times)
+		{
+			// The writer commits in the background, so purging is done once it
+			// has nothing left
+			while (m_writer.stats().depth > 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			times->purge = std::chrono::steady_clock::now() - t;
+			times->retagged = reload.retag.size();
+			times->rejected = reload.rejected.size();
+		}
+
+		if (!sameDb || leasesChanged)
+			loadLeases(reload, sameDb);
+
+		// Taken by the writer whenever it has nothing to write
+		if (m_cfg.Backup_present())
+		{
+			const PmConfig::Backup& b = m_cfg.Backup();
+			std::chrono::seconds interval = b.interval_present() ? std::chrono::seconds(b.interval()) : BACKUP_INTERVAL;
+			m_writer.backup(b.path(), b.pagesPerStep_present() ? b.pagesPerStep() : BACKUP_PAGES, std::max(interval, std::chrono::seconds(1)));
+		}
+		else
+			m_writer.backup("", 0, std::chrono::seconds(0));
+
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Configured " << m_cfg.range().size() << " postmark ranges, " << removed << " removed");
 	}
 	catch (const xml_schema::parser_exception& ex)
 	{
@@ -183,175 +580,1333 @@ void Postmarks::configure(const std::string& cfgStr)
 		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "CONFIG ERROR: The following errors were found:\r\n" << err.str());
 		m_hub.sendMsg(PubSub::Message{{ "Error", "Postmarks", "Config" }, err.str()});
 	}
+	catch (const std::regex_error& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "CONFIG ERROR: Invalid range regex: " << ex.what());
+		m_hub.sendMsg(PubSub::Message{{ "Error", "Postmarks", "Config" }, ex.what()});
+	}
 }
 
-void Postmarks::processMsg(PubSub::Message&& m)
+bool Postmarks::configureTimed(const std::string& cfgStr, StartupTimes& times)
 {
-	std::string str;
-	LOG(Logging::LL_Debug, Logging::LC_Postmarks, "Received msg " << PubSub::toString(m.subject, str));
-
-	std::unique_lock<std::recursive_mutex> syn(m_lk);
-
-	if (PubSub::match(SUB_CFG, m.subject))
-		configure(m.payload);
-#if defined(_DEBUG)
-	else if (PubSub::match(SUB_DIE, m.subject))
-		SetEvent(g_exitEvent);
-#endif
-	else if (PubSub::match(SUB_PMREQ, m.subject))
-		assignPostmark(m.payload);
-	else
-		// Unknown message - weird
-		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Received unknown msg " << PubSub::toString(m.subject, str));
-	;
+	times = StartupTimes();
+	configure(cfgStr, &times);
+	return haveCfg;
 }
 
-bool Postmarks::getStoredPostmark(postmarks::pmRsp& rsp)
+bool Postmarks::exportPostmarks(const std::string& cfgStr, const std::string& file)
 {
-	sqlite3_stmt* stmt;
-	std::stringstream sql;
-	sql << "SELECT * FROM Postmarks WHERE device = '" << rsp.devId() << "'";
-	sqlite3_prepare_v2(m_pmdb, sql.str().c_str(), sql.str().size(), &stmt, nullptr);
-
-	bool found = false;
-	//while (!done)
-	//{
-	switch (sqlite3_step(stmt))
+	try
 	{
-	case SQLITE_ROW:
-		rsp.pm(sqlite3_column_int(stmt, 0));
-		found = true;
-		break;
-	case SQLITE_DONE:
-		break;
-	default:
-		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error creating reading postmarks");
-		break;
-	}
-	//}
+		std::unique_ptr<PmConfig::Postmarks> cfg = parseConfig(cfgStr);
 
-	sqlite3_finalize(stmt);
-	return found;
-}
+		std::unique_ptr<PmStore> store = PmStore::create(cfg->DbFile(), m_log, storeOptions(*cfg));
+		if (!store || !store->open(cfg->DbFile()))
+		{
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open " << cfg->DbFile() << " to export");
+			return false;
+		}
 
-bool Postmarks::updStoredPostmark(postmarks::pmRsp& rsp)
-{
-	if (!rsp.pm_present())
-		return false;
+		std::ofstream os(file, std::ios::binary | std::ios::trunc);
+		if (!os)
+		{
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't create " << file);
+			return false;
+		}
 
-	if (getStoredPostmark(rsp))
-	{
-		std::stringstream sql;
-		sql << "UPDATE Postmarks SET pm = " << rsp.pm() << " WHERE device = '" << rsp.devId() << "'";
-		sqlite3_exec(m_pmdb, sql.str().c_str(), nullptr, nullptr, nullptr);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		size_t n = 0;
+		bool ok;
+		{
+			PmTransfer::Writer w(os, PmTransfer::formatOf(file));
+			ok = store->loadAll([&](const std::string& devId, uint32_t pm, int64_t rangeId, bool, int64_t)
+			{
+				w.write(devId, pm, rangeId);
+				++n;
+			});
+		}
+		os.flush();
+		ok = ok && os.good();
+
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, (ok ? "Exported " : "Failed exporting ") << n << " postmarks to " << file << " in "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms");
+		return ok;
 	}
-	else
+	catch (const xml_schema::parser_exception& ex)
 	{
-		std::stringstream sql;
-		sql << "INSERT INTO Postmarks VALUES (" << rsp.pm() << ",'" << rsp.devId() << "')";
-		sqlite3_exec(m_pmdb, sql.str().c_str(), nullptr, nullptr, nullptr);
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "CONFIG ERROR: parser_exception " << ex.text() << " " << ex.what() << " at " << (int)ex.line() << ":" << (int)ex.column());
+		return false;
 	}
-	return sqlite3_changes(m_pmdb) > 0;
 }
 
-void Postmarks::assignPostmark(const std::string& reqStr)
+bool Postmarks::importPostmarks(const std::string& cfgStr, const std::string& file)
 {
-	postmarks::pmReq_paggr s;
-	xml_schema::document_pimpl d(s.root_parser(), s.root_name());
-
-	s.pre();
-
-	try
+	std::ifstream is(file, std::ios::binary);
+	if (!is)
 	{
-		std::istringstream reqstrm(reqStr);
-		d.parse(reqstrm);
-
-		std::unique_lock<std::recursive_mutex> sync(m_lk);
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open " << file);
+		return false;
+	}
 
-		postmarks::pmReq req = s.post();
-		if (req.devId().empty())
-			return;  // Do nothing
+	configure(cfgStr);
+	if (!haveCfg)
+		return false;
 
-		postmarks::pmRsp rsp;
-		rsp.devId(req.devId());
+	// Nothing else is writing, so once the writer has drained the import goes
+	// straight to the store as one transaction
+	m_writer.close();
 
-		uint32_t assigned = Postmarks_t::MAX_N;
-		auto assign = [&]()
-		{
-			for (regex_pm_t::value_type& v : m_postmarks)
-			{
-				if (!v.second.full())
-				{
-					if (assigned != Postmarks_t::MAX_N)
-					{
-						v.second.addNum(assigned);
-						continue;
-					}
+	std::unique_lock<std::recursive_mutex> sync(m_lk);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-					if (std::regex_match(req.devId(), v.first))
-					{
-						if (req.requested_present() && !v.second.contains(req.requested()))
-						{
-							v.second.addNum(req.requested());
-							rsp.pm(req.requested());
-						}
-						else
-							rsp.pm(v.second.addLowestUnused());
+	// Checked against m_used, and devices looked up as a request would, so
+	// no second copy of the db is needed. Nothing live changes until the
+	// whole file has been read and written, so postmarks taken or given up by
+	// earlier rows are staged here, an empty device meaning given up
+	std::unordered_map<uint32_t, std::string> staged;
 
-						assigned = rsp.pm();
-					}
-				}
-			}
-		};
+	struct Row
+	{
+		std::string devId;
+		uint32_t pm;
+		int64_t rangeId;
+		uint32_t prev; // MAX_N if it had none
+	};
+	std::vector<Row> rows;
+	std::unordered_set<std::string> seen;
+	size_t duplicate = 0, noRange = 0, taken = 0;
 
-		// Check to see if the devId is already in the db
-		if (getStoredPostmark(rsp))
+	PmTransfer::Reader r(is, PmTransfer::formatOf(file));
+	std::string devId;
+	uint32_t pm;
+	while (r.next(devId, pm))
+	{
+		if (!seen.insert(devId).second)
 		{
-			if (req.requested_present() && rsp.pm() != req.requested())
-			{
-				for (regex_pm_t::value_type& v : m_postmarks)
-					v.second.removeNum(rsp.pm());
+			++duplicate;
+			continue;
+		}
 
-				assign();
-				if (assigned != Postmarks_t::MAX_N)
-					updStoredPostmark(rsp);
-			}
+		size_t idx = matchRange(m_postmarks, devId, pm);
+		if (idx == m_postmarks.size())
+		{
+			++noRange;
+			continue;
 		}
-		else
+
+		// Each device comes once, so what it holds is still what is live
+		uint32_t prev;
+		if (!lookup(devId, prev))
+			prev = Postmarks_t::MAX_N;
+
+		std::unordered_map<uint32_t, std::string>::const_iterator st = staged.find(pm);
+		bool held = st != staged.end() ? !st->second.empty() : m_used.contains(pm);
+		if (held && prev != pm)
 		{
-			assign();
-			if (assigned != Postmarks_t::MAX_N)
-				updStoredPostmark(rsp);
+			++taken;
+			continue;
 		}
 
-		enqueue(rsp);
+		// An import replaces a device's current postmark
+		if (prev == pm)
+			prev = Postmarks_t::MAX_N;
+		else if (prev != Postmarks_t::MAX_N)
+			staged[prev].clear();
+
+		staged[pm] = devId;
+		rows.push_back({ devId, pm, m_postmarks[idx].id, prev });
 	}
-	catch (xml_schema::parser_exception& ex)
+
+	if (r.bad())
 	{
-		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "CONFIG ERROR: The following errors were found:\r\n" << ex.what());
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Malformed record after " << r.record() << " in " << file << ". Nothing imported");
+		m_writer.open(*m_store);
+		return false;
+	}
 
-		PubSub::Message err;
-		err.subject = { "Error", "Updates", "Config" };
-		err.payload = ex.text();
-		err.payload += " ";
-		err.payload += ex.what();
+	std::vector<bool> written(rows.size(), false);
+	bool ok = m_store->begin();
+	for (size_t i = 0; ok && i < rows.size(); ++i)
+		written[i] = m_store->upsert(rows[i].devId, rows[i].pm, rows[i].rangeId);
+	ok = ok && m_store->commit();
+	if (!ok)
+		written.assign(rows.size(), false);
 
-		m_hub.sendMsg(err);
+	// Only what is in the store is taken on
+	size_t failed = 0;
+	for (size_t i = 0; i < rows.size(); ++i)
+	{
+		if (!written[i])
+		{
+			++failed;
+			continue;
+		}
+
+		const Row& row = rows[i];
+		if (row.prev != Postmarks_t::MAX_N)
+			m_used.removeNum(row.prev);
+		m_used.addNum(row.pm);
+		m_index.set(row.devId, row.pm);
+		m_cache.put(row.devId, row.pm);
+		m_unwritten.erase(row.devId);
 	}
+
+	m_writer.open(*m_store);
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, (ok ? "Imported " : "Failed importing ") << rows.size() - failed << " postmarks from " << file << " in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms. Skipped "
+		<< duplicate << " duplicate devices, " << noRange << " fitting no range, " << taken << " with a postmark held by another device, "
+		<< failed << " failed to write");
+	return ok;
 }
 
-void Postmarks::processMsg(const postmarks::pmRsp& rsp)
+void Postmarks::processMsg(Received&& r)
 {
-	try
-	{
-		postmarks::pmRsp_saggr rsp_s;
-		xml_schema::document_simpl rsp_d(rsp_s.root_serializer(), rsp_s.root_name());
+	// Each dispatcher thread handles one message at a time, so the stages of
+	// this one collect in t_trace
+	t_trace = TraceRing::Entry();
+	t_trace.at = TraceRing::epochNanos(r.at);
+	timed(Queue, std::chrono::steady_clock::now() - r.at);
+	processMsg(std::move(r.msg));
 
-		std::ostringstream rspstrm;
-		rsp_s.pre(rsp);
+	if (t_trace.devHash)
+		m_trace.record(t_trace);
+}
+
+void Postmarks::timed(Stage s, std::chrono::steady_clock::duration d)
+{
+	m_latency[s].record(d);
+	t_trace.ns[s] = TraceRing::nanos(d);
+}
+
+bool Postmarks::dumpTrace(const std::string& file)
+{
+	if (!m_trace.dump(file, STAGE_NAMES, STAGES))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't write request trace to " << file);
+		return false;
+	}
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Wrote request trace to " << file);
+	return true;
+}
+
+bool Postmarks::record(const std::string& file)
+{
+	if (!m_recorder.open(file))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't record to " << file);
+		return false;
+	}
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Recording inbound messages to " << file);
+	return true;
+}
+
+void Postmarks::recordEvent(const PubSub::Message& msg, std::chrono::steady_clock::time_point at)
+{
+	// Anything else would be ignored on replay anyway
+	for (uint8_t k = 1; k < sizeof(RECORDED) / sizeof(RECORDED[0]); ++k)
+	{
+		if (PubSub::match(*RECORDED[k], msg.subject))
+		{
+			m_recorder.write(k, at, msg.payload);
+			return;
+		}
+	}
+}
+
+bool Postmarks::replay(const std::string& file, bool paced, const std::string& cfgStr)
+{
+	BusRecording rec;
+	if (!rec.open(file))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't replay " << file << ", not a recording");
+		return false;
+	}
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Replaying " << file << (paced ? " at the recorded pace" : " as fast as it goes"));
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t replayed = 0;
+	uint64_t skipped = 0;
+	BusRecording::Entry e;
+	while (rec.next(e))
+	{
+		if (e.kind == 0 || e.kind >= sizeof(RECORDED) / sizeof(RECORDED[0]))
+		{
+			++skipped;
+			continue;
+		}
+
+		// Unpaced is still bounded so the queue never holds the whole file
+		if (paced)
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(e.at));
+		else
+			while (m_inflight >= REPLAY_WINDOW)
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+		PubSub::Message m{ *RECORDED[e.kind], e.kind == RECORDED_CFG && !cfgStr.empty() ? cfgStr : std::move(e.payload) };
+		++m_inflight;
+		enqueue<Received&&>(Received{ std::move(m), std::chrono::steady_clock::now() });
+		++replayed;
+	}
+
+	while (m_inflight > 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Replayed " << replayed << " messages in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms, skipped " << skipped);
+	return true;
+}
+
+void Postmarks::processMsg(PubSub::Message&& m)
+{
+	std::string str;
+	LOG(Logging::LL_Debug, Logging::LC_Postmarks, "Received msg " << PubSub::toString(m.subject, str));
+
+	// configure() and assignPostmark() take m_lk themselves so a
+	// reconfiguration does not hold up requests on the other worker
+	if (PubSub::match(SUB_CFG, m.subject))
+		configure(m.payload);
+#if defined(_DEBUG)
+	else if (PubSub::match(SUB_DIE, m.subject))
+		SetEvent(g_exitEvent);
+#endif
+	else if (PubSub::match(SUB_PMREQ, m.subject))
+		assignPostmark(m.payload);
+	else if (PubSub::match(SUB_PMREL, m.subject))
+		releasePostmarks(m.payload);
+	else if (PubSub::match(SUB_PMQRY, m.subject))
+		queryPostmarks(m.payload);
+	else if (PubSub::match(SUB_STATS, m.subject))
+		dumpLatency(false);
+	else
+		// Unknown message - weird
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Received unknown msg " << PubSub::toString(m.subject, str));
+	;
+
+	--m_inflight;
+}
+
+bool Postmarks::getStoredPostmark(postmarks::pmRsp& rsp)
+{
+	uint32_t pm;
+	if (!lookup(rsp.devId(), pm))
+		return false;
+
+	rsp.pm(pm);
+	return true;
+}
+
+bool Postmarks::lookup(const std::string& devId, uint32_t& pm)
+{
+	// Anything still queued for the writer is newer than the db
+	++m_lookups;
+	std::unordered_map<std::string, std::pair<uint32_t, int64_t> >::const_iterator it = m_unwritten.find(devId);
+	if (it != m_unwritten.end())
+	{
+		++m_lookupHits;
+		if (it->second.first == Postmarks_t::MAX_N)
+			return false; // released
+
+		pm = it->second.first;
+		return true;
+	}
+
+	// When kept, the index has every device
+	if (m_index.enabled())
+	{
+		++m_lookupHits;
+		return m_index.byDevice(devId, pm);
+	}
+
+	PmCache::Found found = m_cache.get(devId, pm);
+	if (found != PmCache::Unknown)
+	{
+		++m_lookupHits;
+		return found == PmCache::Hit; // or never seen
+	}
+
+	if (!m_store || !m_store->get(devId, pm))
+		return false;
+
+	m_cache.put(devId, pm);
+	return true;
+}
+
+void Postmarks::updStoredPostmark(const postmarks::pmRsp& rsp, int64_t rangeId)
+{
+	std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+	m_unwritten[rsp.devId()] = { rsp.pm(), rangeId };
+	m_index.set(rsp.devId(), rsp.pm());
+	m_cache.put(rsp.devId(), rsp.pm());
+	m_writer.push(PmWriter::Record::Upsert, rsp.devId(), rsp.pm(), rangeId);
+	timed(Store, std::chrono::steady_clock::now() - t);
+}
+
+void Postmarks::postmarkWritten(const PmWriter::Record& r, bool ok)
+{
+	m_latency[Write].record(std::chrono::steady_clock::now() - r.queued);
+
+	if (r.op == PmWriter::Record::Touch)
+		return;
+
+	if (r.op == PmWriter::Record::Release)
+	{
+		if (ok)
+		{
+			std::unique_lock<std::recursive_mutex> sync(m_lk);
+
+			for (const std::pair<std::string, uint32_t>& d : r.release->released)
+			{
+				std::unordered_map<std::string, std::pair<uint32_t, int64_t> >::iterator it = m_unwritten.find(d.first);
+				if (it != m_unwritten.end() && it->second.first == Postmarks_t::MAX_N)
+					m_unwritten.erase(it);
+			}
+		}
+
+		r.release->failed = !ok;
+		enqueue(r.release);
+		return;
+	}
+
+	postmarks::pmRsp rsp;
+	rsp.devId(r.devId);
+	rsp.pm_present(false);
+	{
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+
+		// A Delete leaves the device marked released until now
+		uint32_t written = r.op == PmWriter::Record::Delete ? Postmarks_t::MAX_N : r.pm;
+		std::unordered_map<std::string, std::pair<uint32_t, int64_t> >::iterator it = m_unwritten.find(r.devId);
+		bool latest = it != m_unwritten.end() && it->second.first == written;
+
+		if (ok)
+		{
+			if (latest)
+				m_unwritten.erase(it);
+			if (r.op == PmWriter::Record::Upsert)
+				rsp.pm(r.pm);
+		}
+		else if (r.op == PmWriter::Record::Upsert)
+		{
+			// A newer change for the device has taken over and answers for itself
+			if (!latest)
+				return;
+
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Postmark " << r.pm << " for " << r.devId << " was not written, taking it back");
+			m_unwritten.erase(it);
+			unassign(r.devId, r.pm);
+
+			// The store may still hold the postmark the device had before, and
+			// that is what it is told
+			uint32_t pm;
+			if (m_store && m_store->get(r.devId, pm) && m_used.addNum(pm))
+			{
+				m_index.set(r.devId, pm);
+				m_cache.put(r.devId, pm);
+				if (m_reconfiguring)
+					m_cfgChanges.push_back({ r.devId, Postmarks_t::MAX_N, pm, 0 });
+				rsp.pm(pm);
+			}
+		}
+		else
+			// A Delete stays marked released, and is rejected again on the next
+			// full load
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, (r.op == PmWriter::Record::Delete ? "Release" : "Retag") << " of " << r.devId << " was not written");
+	}
+
+	if (r.op == PmWriter::Record::Retag)
+		return;
+
+	enqueue(rsp);
+}
+
+void Postmarks::assignPostmark(const std::string& reqStr)
+{
+	postmarks::pmReq_paggr s;
+	xml_schema::document_pimpl d(s.root_parser(), s.root_name());
+
+	s.pre();
+
+	try
+	{
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		std::istringstream reqstrm(reqStr);
+		d.parse(reqstrm);
+		timed(Parse, std::chrono::steady_clock::now() - t);
+
+		t = std::chrono::steady_clock::now();
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+		timed(Lock, std::chrono::steady_clock::now() - t);
+
+		postmarks::pmReq req = s.post();
+		if (req.devId().empty())
+			return;  // Do nothing
+
+		++m_requests;
+
+		postmarks::pmRsp rsp;
+		rsp.devId(req.devId());
+		t_trace.devHash = TraceRing::hash(req.devId());
+
+		uint32_t assigned = Postmarks_t::MAX_N;
+		int64_t assignedRange = 0;
+		auto assign = [&]()
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (regex_pm_t::value_type& v : m_postmarks)
+			{
+				if (!v.postmarks.full() && std::regex_match(req.devId(), v.regex))
+				{
+					if (req.requested_present() && !v.postmarks.contains(req.requested()))
+					{
+						v.postmarks.addNum(req.requested());
+						rsp.pm(req.requested());
+					}
+					else
+						rsp.pm(v.postmarks.addLowestUnused());
+
+					assigned = rsp.pm();
+					assignedRange = v.id;
+					break;
+				}
+			}
+			timed(Match, std::chrono::steady_clock::now() - start);
+		};
+
+		// Check to see if the devId is already in the db
+		uint32_t previous = Postmarks_t::MAX_N;
+		t = std::chrono::steady_clock::now();
+		bool stored = getStoredPostmark(rsp);
+		timed(Lookup, std::chrono::steady_clock::now() - t);
+		if (stored)
+		{
+			if (req.requested_present() && rsp.pm() != req.requested())
+			{
+				previous = rsp.pm();
+				m_used.removeNum(previous);
+
+				assign();
+				if (assigned != Postmarks_t::MAX_N)
+					updStoredPostmark(rsp, assignedRange);
+			}
+		}
+		else
+		{
+			assign();
+			if (assigned != Postmarks_t::MAX_N)
+				updStoredPostmark(rsp, assignedRange);
+		}
+
+		if (m_reconfiguring && (assigned != Postmarks_t::MAX_N || previous != Postmarks_t::MAX_N))
+			m_cfgChanges.push_back({ req.devId(), previous, assigned, assignedRange });
+
+		// Every request counts as the device being seen. Only the time changes
+		// here, the wheel catches up when the old expiry comes round
+		if ((!m_leaseCfg.empty() || m_sweepAge) && rsp.pm_present())
+		{
+			int64_t now = epochNow();
+			if (assigned != Postmarks_t::MAX_N)
+				trackLease(req.devId(), assigned, assignedRange, now);
+			else
+			{
+				std::unordered_map<std::string, Lease>::iterator it = m_leases.find(req.devId());
+				if (it != m_leases.end())
+					it->second.lastSeen = now;
+			}
+			m_seen[req.devId()] = now;
+		}
+
+		if (rsp.pm_present())
+			t_trace.pm = rsp.pm();
+
+		// A new assignment is published by postmarkWritten() once it is on disk
+		if (assigned == Postmarks_t::MAX_N)
+			enqueue(rsp);
+	}
+	catch (xml_schema::parser_exception& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "CONFIG ERROR: The following errors were found:\r\n" << ex.what());
+
+		PubSub::Message err;
+		err.subject = { "Error", "Updates", "Config" };
+		err.payload = ex.text();
+		err.payload += " ";
+		err.payload += ex.what();
+
+		m_hub.sendMsg(err);
+	}
+}
+
+void Postmarks::releasePostmarks(const std::string& reqStr)
+{
+	pmAdmin::pmRelease_paggr s;
+	xml_schema::document_pimpl d(s.root_parser(), s.root_name());
+
+	s.pre();
+
+	try
+	{
+		std::istringstream reqstrm(reqStr);
+		d.parse(reqstrm);
+
+		std::unique_ptr<pmAdmin::pmRelease> req{s.post()};
+
+		std::shared_ptr<PmWriter::Release> rel = std::make_shared<PmWriter::Release>();
+		if (req->reqId_present())
+			rel->reqId = req->reqId();
+
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+
+		for (const std::string& devId : req->devId())
+		{
+			postmarks::pmRsp rsp;
+			rsp.devId(devId);
+			if (getStoredPostmark(rsp))
+				releaseDevice(devId, rsp.pm(), *rel);
+			else
+				rel->unknown.push_back(devId);
+		}
+
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Releasing " << rel->released.size() << " postmarks, " << rel->unknown.size() << " devices unknown");
+
+		// Answered by postmarkWritten() once on disk, unless there is nothing to write
+		if (rel->released.empty())
+			enqueue(rel);
+		else
+			m_writer.push(rel);
+	}
+	catch (xml_schema::parser_exception& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Invalid release request: " << ex.text() << " " << ex.what());
+	}
+}
+
+void Postmarks::queryPostmarks(const std::string& reqStr)
+{
+	pmAdmin::pmQuery_paggr s;
+	xml_schema::document_pimpl d(s.root_parser(), s.root_name());
+
+	s.pre();
+
+	try
+	{
+		std::istringstream reqstrm(reqStr);
+		d.parse(reqstrm);
+
+		std::unique_ptr<pmAdmin::pmQuery> req{s.post()};
+
+		pmAdmin::pmQueryRsp rsp;
+		if (req->reqId_present())
+			rsp.reqId(req->reqId());
+
+		// Answered from m_index alone where it is kept, and m_lk is only taken
+		// to find a range. Without it a device is looked up as a request would
+		// and anything by postmark comes from the store, as last written
+		bool indexed = m_index.enabled();
+		PmIndex::Held held;
+		if (req->devId_present())
+		{
+			uint32_t pm;
+			bool found;
+			if (indexed)
+				found = m_index.byDevice(req->devId(), pm);
+			else
+			{
+				std::unique_lock<std::recursive_mutex> sync(m_lk);
+				found = lookup(req->devId(), pm);
+			}
+			if (found)
+				held.push_back({ req->devId(), pm });
+		}
+		else if (req->pm_present())
+		{
+			std::string devId;
+			if (indexed)
+			{
+				if (m_index.byPm(req->pm(), devId))
+					held.push_back({ devId, req->pm() });
+			}
+			else
+			{
+				std::unique_lock<std::recursive_mutex> sync(m_lk);
+				if (m_store)
+					m_store->held(req->pm(), req->pm(), 1, held);
+			}
+		}
+		else if (req->range_present())
+		{
+			bool found;
+			uint32_t from = 0, to = 0;
+			{
+				std::unique_lock<std::recursive_mutex> sync(m_lk);
+				found = req->range() < m_cfg.range().size();
+				if (found)
+				{
+					from = m_cfg.range()[req->range()].from();
+					to = m_cfg.range()[req->range()].to();
+				}
+			}
+
+			size_t limit = req->limit_present() ? std::min<size_t>(std::max<size_t>(req->limit(), 1), QUERY_LIMIT) : QUERY_LIMIT;
+			if (!found)
+				rsp.error("No range " + std::to_string(req->range()));
+			else if (req->after_present() && req->after() >= to)
+				; // past the end
+			else
+			{
+				uint32_t first = req->after_present() ? std::max(from, req->after() + 1) : from;
+				bool more;
+				if (indexed)
+					more = m_index.range(first, to, limit, held);
+				else
+				{
+					std::unique_lock<std::recursive_mutex> sync(m_lk);
+					more = m_store && m_store->held(first, to, limit, held);
+				}
+				if (more)
+					rsp.next(held.back().second);
+			}
+		}
+		else
+			rsp.error("Query by devId, pm or range");
+
+		for (const std::pair<std::string, uint32_t>& h : held)
+		{
+			pmAdmin::Held* p = new pmAdmin::Held;
+			p->devId(h.first);
+			p->pm(h.second);
+			rsp.held().push_back(p);
+		}
+
+		pmAdmin::pmQueryRsp_saggr rsp_s;
+		xml_schema::document_simpl rsp_d(rsp_s.root_serializer(), rsp_s.root_name());
+
+		std::ostringstream rspstrm;
+		rsp_s.pre(rsp);
+		rsp_d.serialize(rspstrm, 0);
+
+		m_hub.sendMsg(PubSub::Message{PUB_PMQRYRSP, rspstrm.str()});
+	}
+	catch (xml_schema::parser_exception& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Invalid query request: " << ex.text() << " " << ex.what());
+	}
+	catch (xml_schema::serializer_xml& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "serializer_xml exception: " << ex.text());
+	}
+	catch (xml_schema::serializer_schema& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "serializer_schema exception: " << ex.text());
+	}
+}
+
+void Postmarks::unassign(const std::string& devId, uint32_t pm)
+{
+	m_used.removeNum(pm);
+	m_index.erase(devId);
+	m_cache.erase(devId);
+	if (m_reconfiguring)
+		m_cfgChanges.push_back({ devId, pm, Postmarks_t::MAX_N, 0 });
+
+	m_leases.erase(devId);
+	m_seen.erase(devId);
+	m_seenFlushed.erase(devId);
+}
+
+void Postmarks::releaseDevice(const std::string& devId, uint32_t pm, PmWriter::Release& rel)
+{
+	// The number is free again straight away, and lookups miss from now on
+	// rather than once the release is on disk
+	unassign(devId, pm);
+	m_unwritten[devId] = { Postmarks_t::MAX_N, 0 };
+
+	rel.released.push_back({ devId, pm });
+}
+
+void Postmarks::processMsg(const std::shared_ptr<PmWriter::Release>& rel)
+{
+	// Devices reclaimed by the service are told in the usual way, as if their
+	// postmark had been purged by a reconfiguration
+	if (rel->expired)
+	{
+		if (rel->failed)
+			return;
+
+		for (const std::pair<std::string, uint32_t>& r : rel->released)
+		{
+			postmarks::pmRsp rsp;
+			rsp.devId(r.first);
+			rsp.pm_present(false);
+			processMsg(rsp);
+		}
+		return;
+	}
+
+	try
+	{
+		pmAdmin::pmReleaseRsp rsp;
+		if (!rel->reqId.empty())
+			rsp.reqId(rel->reqId);
+		if (rel->failed)
+			rsp.failed(true);
+
+		for (const std::pair<std::string, uint32_t>& r : rel->released)
+		{
+			pmAdmin::Released* p = new pmAdmin::Released;
+			p->devId(r.first);
+			p->pm(r.second);
+			rsp.released().push_back(p);
+		}
+		for (const std::string& u : rel->unknown)
+			rsp.unknown().push_back(u);
+
+		pmAdmin::pmReleaseRsp_saggr rsp_s;
+		xml_schema::document_simpl rsp_d(rsp_s.root_serializer(), rsp_s.root_name());
+
+		std::ostringstream rspstrm;
+		rsp_s.pre(rsp);
+		rsp_d.serialize(rspstrm, 0);
+
+		m_hub.sendMsg(PubSub::Message{PUB_PMRELRSP, rspstrm.str()});
+	}
+	catch (xml_schema::serializer_xml& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "serializer_xml exception: " << ex.text());
+	}
+	catch (xml_schema::serializer_schema& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "serializer_schema exception: " << ex.text());
+	}
+}
+
+int64_t Postmarks::epochNow()
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int64_t Postmarks::leaseOf(int64_t rangeId) const
+{
+	std::map<int64_t, int64_t>::const_iterator it = m_leaseCfg.find(rangeId);
+	return it == m_leaseCfg.end() ? 0 : it->second;
+}
+
+void Postmarks::trackLease(const std::string& devId, uint32_t pm, int64_t rangeId, int64_t now)
+{
+	int64_t lease = leaseOf(rangeId);
+	if (!lease)
+	{
+		m_leases.erase(devId);
+		return;
+	}
+
+	Lease& l = m_leases[devId];
+	l = { pm, rangeId, now, ++m_leaseGen };
+	m_expiry.add(now + lease, { devId, l.gen });
+}
+
+void Postmarks::loadLeases(const PmReload& reload, bool keep)
+{
+	int64_t now = epochNow();
+	std::map<int64_t, int64_t> leases;
+	{
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+		leases = m_leaseCfg;
+		if (leases.empty())
+		{
+			m_leases.clear();
+			m_expiry.clear(now);
+			return;
+		}
+	}
+
+	// Read without m_lk like the reload. Devices never seen since leases were
+	// introduced count as seen now. m_store only changes under m_cfgLk, which
+	// the caller holds
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::unordered_map<std::string, Lease> found;
+	m_store->loadAll([&](const std::string& devId, uint32_t pm, int64_t rangeId, bool tagged, int64_t lastSeen)
+	{
+		if (tagged && leases.count(rangeId))
+			found[devId] = { pm, rangeId, lastSeen ? lastSeen : now, 0 };
+	});
+
+	// Rows only just retagged are still untagged in the store
+	for (const PmTag& t : reload.retag)
+		if (leases.count(t.rangeId) && !found.count(t.devId))
+			found[t.devId] = { t.pm, t.rangeId, now, 0 };
+
+	std::unique_lock<std::recursive_mutex> sync(m_lk);
+
+	// Anything released or reassigned since the scan read it is left to the
+	// request path, which tracked it itself
+	for (std::unordered_map<std::string, Lease>::iterator it = found.begin(); it != found.end();)
+	{
+		std::unordered_map<std::string, std::pair<uint32_t, int64_t> >::const_iterator u = m_unwritten.find(it->first);
+		if (u != m_unwritten.end() && u->second.first != it->second.pm)
+			it = found.erase(it);
+		else
+			++it;
+	}
+
+	if (keep)
+	{
+		for (const std::pair<const std::string, Lease>& l : m_leases)
+		{
+			if (!m_leaseCfg.count(l.second.rangeId))
+				continue;
+
+			std::unordered_map<std::string, Lease>::iterator f = found.find(l.first);
+			if (f == found.end())
+				found.insert(l);
+			else if (f->second.pm == l.second.pm)
+				f->second.lastSeen = std::max(f->second.lastSeen, l.second.lastSeen);
+		}
+	}
+
+	m_leases.swap(found);
+	m_expiry.clear(now);
+	for (std::pair<const std::string, Lease>& l : m_leases)
+	{
+		l.second.gen = ++m_leaseGen;
+		m_expiry.add(l.second.lastSeen + leaseOf(l.second.rangeId), { l.first, l.second.gen });
+	}
+
+	LOG(Logging::LL_Info, Logging::LC_Postmarks, "Tracking " << m_leases.size() << " leased postmarks, loaded in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms");
+}
+
+void Postmarks::reclaimExpired(int64_t now)
+{
+	// A small batch per tick so the dispatcher is never held for long. A
+	// backlog after a long stop is worked off a batch a second
+	std::vector<std::pair<std::string, uint32_t> > due;
+	m_expiry.advance(now);
+	m_expiry.take(due, LEASE_BATCH);
+
+	std::shared_ptr<PmWriter::Release> rel;
+	for (const std::pair<std::string, uint32_t>& d : due)
+	{
+		std::unordered_map<std::string, Lease>::iterator it = m_leases.find(d.first);
+		if (it == m_leases.end() || it->second.gen != d.second)
+			continue; // released or reassigned since
+
+		int64_t lease = leaseOf(it->second.rangeId);
+		if (!lease)
+		{
+			m_leases.erase(it);
+			continue;
+		}
+
+		// Seen since this entry was filed
+		int64_t expires = it->second.lastSeen + lease;
+		if (expires > now)
+		{
+			m_expiry.add(expires, d);
+			continue;
+		}
+
+		postmarks::pmRsp rsp;
+		rsp.devId(d.first);
+		if (!getStoredPostmark(rsp) || rsp.pm() != it->second.pm)
+		{
+			m_leases.erase(it);
+			continue;
+		}
+
+		if (!rel)
+		{
+			rel = std::make_shared<PmWriter::Release>();
+			rel->expired = true;
+		}
+		releaseDevice(d.first, rsp.pm(), *rel);
+	}
+
+	if (rel)
+	{
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Reclaiming " << rel->released.size() << " expired postmarks, " << m_expiry.due() << " more due");
+		m_writer.push(rel);
+	}
+}
+
+void Postmarks::flushSeen()
+{
+	// Queued behind the assignments they refer to. Losing the last minute of
+	// these in a crash only makes a lease run slightly short
+	for (const std::pair<const std::string, int64_t>& s : m_seen)
+		m_writer.push(PmWriter::Record::Touch, s.first, 0, s.second);
+	m_seenFlushed.swap(m_seen);
+	m_seen.clear();
+}
+
+void Postmarks::dumpLatency(bool reset)
+{
+	// Periodic dumps cover the interval since the last one. On demand shows
+	// the interval so far and leaves it running
+	for (int s = 0; s < STAGES; ++s)
+	{
+		LatencyHistogram::Summary sum = m_latency[s].summary(reset);
+		if (sum.count)
+			LOG(Logging::LL_Info, Logging::LC_Postmarks, "Latency " << STAGE_NAMES[s] << ": " << sum);
+	}
+}
+
+void Postmarks::publishStatus()
+{
+	try
+	{
+		pmAdmin::pmStatus st;
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		uint64_t requests = m_requests;
+		double secs = std::chrono::duration<double>(now - m_statusAt).count();
+		st.requestsPerSec(secs > 0 ? (requests - m_statusRequests) / secs : 0);
+		m_statusRequests = requests;
+		m_statusAt = now;
+
+		PmWriter::Stats ws = m_writer.stats();
+		st.queued(m_inflight > 0 ? m_inflight.load() : 0);
+		st.writeQueued(ws.depth);
+		st.writeFailures(ws.failures);
+		st.commitUs(ws.lastCommit.count());
+		st.commitAvgUs(ws.batches ? ws.totalCommit.count() / ws.batches : 0);
+		st.commitMaxUs(ws.maxCommit.count());
+		st.writeP99Us(m_latency[Write].summary(false).p99 / 1000);
+
+		uint64_t lookups = m_lookups;
+		st.lookups(lookups);
+		st.lookupHitRate(lookups ? (double)m_lookupHits / lookups : 0);
+
+		{
+			std::unique_lock<std::recursive_mutex> sync(m_lk);
+
+			// Ranges that overlap share postmarks, so their counts do too
+			for (size_t i = 0; i < m_postmarks.size() && i < m_cfg.range().size(); ++i)
+			{
+				const PmConfig::Range& r = m_cfg.range()[i];
+				size_t pieces = 0;
+				uint64_t size = (uint64_t)r.to() - r.from() + 1;
+				uint64_t free = r.from() <= r.to() ? m_postmarks[i].postmarks.getUnused(&pieces) : 0;
+
+				pmAdmin::RangeStatus* rs = new pmAdmin::RangeStatus;
+				rs->regex(r.regex());
+				rs->from(r.from());
+				rs->to(r.to());
+				rs->used(r.from() <= r.to() ? size - free : 0);
+				rs->free(free);
+				rs->freeIntervals(pieces);
+				st.range().push_back(rs);
+			}
+		}
+
+		pmAdmin::pmStatus_saggr st_s;
+		xml_schema::document_simpl st_d(st_s.root_serializer(), st_s.root_name());
+
+		std::ostringstream ststrm;
+		st_s.pre(st);
+		st_d.serialize(ststrm, 0);
+
+		m_hub.sendMsg(PubSub::Message{PUB_STATUS, ststrm.str(), TTL_STATUS});
+	}
+	catch (xml_schema::serializer_xml& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "serializer_xml exception: " << ex.text());
+	}
+	catch (xml_schema::serializer_schema& ex)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "serializer_schema exception: " << ex.text());
+	}
+}
+
+void Postmarks::metrics(std::ostream& os)
+{
+	auto counter = [&os](const char* name, const char* help, uint64_t v)
+	{
+		os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " counter\n" << name << ' ' << v << '\n';
+	};
+	auto gauge = [&os](const char* name, const char* help, uint64_t v)
+	{
+		os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " gauge\n" << name << ' ' << v << '\n';
+	};
+
+	PmWriter::Stats ws = m_writer.stats();
+	counter("postmarks_requests_total", "Postmark requests handled", m_requests);
+	counter("postmarks_lookups_total", "Stored postmark lookups", m_lookups);
+	counter("postmarks_lookup_hits_total", "Lookups answered without going to the store", m_lookupHits);
+	gauge("postmarks_queued", "Bus messages waiting for the dispatcher", m_inflight > 0 ? m_inflight.load() : 0);
+	gauge("postmarks_write_queued", "Records waiting for the writer", ws.depth);
+	counter("postmarks_write_records_total", "Records written", ws.records);
+	counter("postmarks_write_batches_total", "Write transactions", ws.batches);
+	counter("postmarks_write_failures_total", "Records that failed to write", ws.failures);
+	counter("postmarks_backups_total", "Backups completed", ws.backups);
+	counter("postmarks_backup_failures_total", "Backups that failed", ws.backupFailures);
+	gauge("postmarks_index_size", "Postmarks held", m_index.size());
+
+	PmCache::Stats cs = m_cache.stats();
+	gauge("postmarks_cache_entries", "Devices in the lookup cache", cs.entries);
+	gauge("postmarks_cache_bytes", "Memory held by the lookup cache", cs.bytes);
+	gauge("postmarks_cache_budget_bytes", "Most the lookup cache may hold, 0 when off", cs.budget);
+	gauge("postmarks_cache_filter_bytes", "Memory held by the filter of devices ever stored", cs.filterBytes);
+	counter("postmarks_cache_hits_total", "Lookups answered from the cache", cs.hits);
+	counter("postmarks_cache_misses_total", "Lookups the cache sent to the store", cs.misses);
+	counter("postmarks_cache_filtered_total", "Lookups answered as never seen by the filter", cs.filtered);
+	counter("postmarks_cache_evictions_total", "Devices evicted to stay in budget", cs.evictions);
+
+	os << "# HELP postmarks_range_free Free postmarks in each configured range\n# TYPE postmarks_range_free gauge\n";
+	std::ostringstream pieces;
+	{
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+
+		for (size_t i = 0; i < m_postmarks.size() && i < m_cfg.range().size(); ++i)
+		{
+			const PmConfig::Range& r = m_cfg.range()[i];
+			size_t n = 0;
+			uint64_t free = r.from() <= r.to() ? m_postmarks[i].postmarks.getUnused(&n) : 0;
+			os << "postmarks_range_free{range=\"" << i << "\",from=\"" << r.from() << "\",to=\"" << r.to() << "\"} " << free << '\n';
+			pieces << "postmarks_range_free_intervals{range=\"" << i << "\",from=\"" << r.from() << "\",to=\"" << r.to() << "\"} " << n << '\n';
+		}
+	}
+	os << "# HELP postmarks_range_free_intervals Runs of free postmarks in each range, a measure of fragmentation\n"
+		"# TYPE postmarks_range_free_intervals gauge\n" << pieces.str();
+
+	os << "# HELP postmarks_stage_seconds Time spent in each stage of the request path\n# TYPE postmarks_stage_seconds histogram\n";
+	for (int s = 0; s < STAGES; ++s)
+	{
+		LatencyHistogram::Totals t = m_latency[s].totals();
+		for (const std::pair<double, uint64_t>& b : t.buckets)
+			os << "postmarks_stage_seconds_bucket{stage=\"" << STAGE_NAMES[s] << "\",le=\"" << b.first << "\"} " << b.second << '\n';
+		os << "postmarks_stage_seconds_bucket{stage=\"" << STAGE_NAMES[s] << "\",le=\"+Inf\"} " << t.count << '\n';
+		os << "postmarks_stage_seconds_sum{stage=\"" << STAGE_NAMES[s] << "\"} " << t.sum << '\n';
+		os << "postmarks_stage_seconds_count{stage=\"" << STAGE_NAMES[s] << "\"} " << t.count << '\n';
+	}
+}
+
+std::vector<Postmarks::StageTotal> Postmarks::stageTotals() const
+{
+	std::vector<StageTotal> totals;
+	for (int s = 0; s < STAGES; ++s)
+	{
+		LatencyHistogram::Totals t = m_latency[s].totals();
+		totals.push_back({ STAGE_NAMES[s], t.count, t.sum });
+	}
+	return totals;
+}
+
+void Postmarks::tickerRun()
+{
+	std::unique_lock<std::mutex> lk(m_tickLk);
+	while (!m_tickCv.wait_for(lk, std::chrono::seconds(1), [this]() { return !m_ticking; }))
+	{
+		if (!m_tickQueued.exchange(true))
+			enqueue(Tick());
+	}
+}
+
+void Postmarks::processMsg(const Tick&)
+{
+	m_tickQueued = false;
+
+	bool sweeping, status = false;
+	{
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+		if (!haveCfg)
+			return;
+
+		int64_t now = epochNow();
+		if (!m_leases.empty())
+			reclaimExpired(now);
+
+		if (now >= m_nextFlush)
+		{
+			flushSeen();
+			m_nextFlush = now + SEEN_FLUSH;
+		}
+
+		if (now >= m_nextLatencyDump)
+		{
+			if (m_nextLatencyDump)
+				dumpLatency(true);
+			m_nextLatencyDump = now + LATENCY_DUMP;
+		}
+
+		if (m_statusInterval && now >= m_nextStatus)
+		{
+			status = m_nextStatus != 0;
+			m_nextStatus = now + m_statusInterval;
+		}
+
+		sweeping = m_sweepAge != 0;
+	}
+
+	if (status)
+		publishStatus();
+
+	// Picks up again once a second, whatever stopped it last time
+	if (sweeping && m_inflight == 0 && !m_sweepQueued.exchange(true))
+		enqueue(SweepStep());
+}
+
+void Postmarks::processMsg(const SweepStep&)
+{
+	bool more = sweep();
+	m_sweepQueued = false;
+
+	// Straight on with the next chunk while there is nothing else to do.
+	// Anything arriving meanwhile is queued ahead of it
+	if (more && m_inflight == 0 && !m_sweepQueued.exchange(true))
+		enqueue(SweepStep());
+}
+
+bool Postmarks::sweep()
+{
+	// m_store only changes under m_cfgLk. A reconfiguration in progress goes
+	// first, as does a step already running on the other worker
+	std::unique_lock<std::mutex> sweepSync(m_sweepLk, std::try_to_lock);
+	std::unique_lock<std::mutex> cfgSync(m_cfgLk, std::try_to_lock);
+	if (!sweepSync || !cfgSync || !m_store)
+		return false;
+
+	int64_t age;
+	size_t chunk;
+	double rate;
+	{
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+		age = m_sweepAge;
+		chunk = m_sweepChunk;
+		rate = m_sweepRate;
+	}
+	if (!age)
+		return false;
+
+	int64_t now = epochNow();
+	if (m_store.get() != m_sweepStore)
+	{
+		m_sweepStore = m_store.get();
+		m_sweepCursor = PmStore::Cursor();
+		m_sweepDue.clear();
+		m_nextSweep = 0;
+	}
+
+	// No more than a second's worth at once
+	std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+	m_sweepTokens = std::min(rate, m_sweepTokens + rate * std::chrono::duration<double>(t - m_sweepRefill).count());
+	m_sweepRefill = t;
+
+	if (m_sweepDue.empty())
+	{
+		if (now < m_nextSweep)
+			return false;
+
+		if (!m_sweepCursor.started)
+		{
+			LOG(Logging::LL_Info, Logging::LC_Postmarks, "Sweeping for devices not seen in " << age << "s");
+			m_swept = 0;
+		}
+
+		std::vector<std::string> unseen;
+		m_store->scan(m_sweepCursor, chunk, [&](const std::string& devId, uint32_t pm, int64_t, bool, int64_t lastSeen)
+		{
+			if (!lastSeen)
+				unseen.push_back(devId);
+			else if (lastSeen + age <= now)
+				m_sweepDue.push_back({ devId, pm });
+		});
+
+		// Devices with no last seen time yet start ageing from the first sweep
+		// that finds them
+		if (!unseen.empty())
+		{
+			std::unique_lock<std::recursive_mutex> sync(m_lk);
+			for (const std::string& devId : unseen)
+				m_seen.insert({ devId, now });
+		}
+
+		if (m_sweepCursor.done)
+		{
+			m_sweepCursor = PmStore::Cursor();
+			m_nextSweep = now + SWEEP_PAUSE;
+		}
+	}
+
+	std::shared_ptr<PmWriter::Release> rel;
+	{
+		std::unique_lock<std::recursive_mutex> sync(m_lk);
+
+		// Gives way between devices as soon as a request arrives
+		while (!m_sweepDue.empty() && m_sweepTokens >= 1 && m_inflight == 0)
+		{
+			Stale s = m_sweepDue.back();
+			m_sweepDue.pop_back();
+
+			// Seen since the scan read it
+			std::unordered_map<std::string, int64_t>::const_iterator seen = m_seen.find(s.devId);
+			if (seen != m_seen.end() && seen->second + age > now)
+				continue;
+			seen = m_seenFlushed.find(s.devId);
+			if (seen != m_seenFlushed.end() && seen->second + age > now)
+				continue;
+
+			postmarks::pmRsp rsp;
+			rsp.devId(s.devId);
+			if (!getStoredPostmark(rsp) || rsp.pm() != s.pm)
+				continue;
+
+			if (!rel)
+			{
+				rel = std::make_shared<PmWriter::Release>();
+				rel->expired = true;
+			}
+			releaseDevice(s.devId, s.pm, *rel);
+			m_sweepTokens -= 1;
+		}
+	}
+
+	if (rel)
+	{
+		m_swept += rel->released.size();
+		m_writer.push(rel);
+	}
+
+	if (m_sweepDue.empty() && !m_sweepCursor.started && m_nextSweep > now)
+	{
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Sweep reclaimed " << m_swept << " postmarks");
+		return false;
+	}
+
+	return m_sweepDue.empty() || m_sweepTokens >= 1;
+}
+
+void Postmarks::processMsg(const postmarks::pmRsp& rsp)
+{
+	try
+	{
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		postmarks::pmRsp_saggr rsp_s;
+		xml_schema::document_simpl rsp_d(rsp_s.root_serializer(), rsp_s.root_name());
+
+		std::ostringstream rspstrm;
+		rsp_s.pre(rsp);
 		rsp_d.serialize(rspstrm, 0);
 
+		std::chrono::steady_clock::time_point s = std::chrono::steady_clock::now();
+		m_latency[Serialize].record(s - t);
+
 		m_hub.sendMsg(PubSub::Message{PUB_PMRSP, rspstrm.str(), TTL_LONGTIME});
+		std::chrono::steady_clock::time_point e = std::chrono::steady_clock::now();
+		m_latency[Publish].record(e - s);
+
+		TraceRing::Entry tr;
+		tr.devHash = TraceRing::hash(rsp.devId());
+		tr.at = TraceRing::epochNanos(e);
+		tr.kind = TraceRing::Response;
+		if (rsp.pm_present())
+			tr.pm = rsp.pm();
+		tr.ns[Serialize] = TraceRing::nanos(s - t);
+		tr.ns[Publish] = TraceRing::nanos(e - s);
+		m_trace.record(tr);
 	}
 	catch (xml_schema::serializer_xml& ex)
 	{
@@ -5,20 +5,33 @@
 #include "HubApp/HubApp.h"
 #include "PubSubLib/PubSub.h"
 #include "pugixml/pugixml.hpp"
-#include "sqlite3.h"
 #include "NumericRangeHandler.h"
+#include "PmStore.h"
+#include "PmWriter.h"
+#include "PmIndex.h"
+#include "PmCache.h"
+#include "Latency.h"
+#include "Trace.h"
+#include "Recording.h"
+#include "TimerWheel.h"
 #include "configuration.hxx"
 #include "postmark.hxx"
+#include "postmarkAdmin.hxx"
 
 #include <boost/asio.hpp>
 #include <filesystem>
 #include <set>
+#include <map>
+#include <unordered_map>
 #include <vector>
 #include <chrono>
 #include <thread>
 #include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <istream>
+#include <ostream>
 
 #if defined(_DEBUG) && defined(WIN32)
 extern HANDLE g_exitEvent;
@@ -36,39 +49,264 @@ namespace BA = boost::asio;
 
 class Postmarks : public Task::TActiveTask<Postmarks>, public Logging::LogClient
 {
+public:
+	// Where the time goes in taking a configuration on a fresh start. Each row
+	// read is split between the store producing it and the two kinds of work
+	// done on it, so the phases add up to the whole
+	struct StartupTimes
+	{
+		std::chrono::steady_clock::duration parse{};    // the config, and compiling the range regexes
+		std::chrono::steady_clock::duration open{};     // the store
+		std::chrono::steady_clock::duration scan{};     // the store reading rows
+		std::chrono::steady_clock::duration classify{}; // matching rows to ranges
+		std::chrono::steady_clock::duration rebuild{};  // the occupancy and index
+		std::chrono::steady_clock::duration purge{};    // until retags and deletes are committed
+		size_t rows = 0;
+		size_t retagged = 0;
+		size_t rejected = 0;
+	};
+
+private:
 	std::recursive_mutex m_lk; // General lock on dispatcher state
 
 	friend HubApps::HubApp;
 	HubApps::HubApp m_hub;
-	void receiveEvent(PubSub::Message&& msg) { /*hand off to thread queue*/enqueue<PubSub::Message&&>(std::move(msg)); }
+	void receiveEvent(PubSub::Message&& msg)
+	{
+		/*hand off to thread queue*/
+		std::chrono::steady_clock::time_point at = std::chrono::steady_clock::now();
+		if (m_recorder.isOpen())
+			recordEvent(msg, at);
+		++m_inflight;
+		enqueue<Received&&>(Received{ std::move(msg), at });
+	}
 	void receiveUnknown(uint8_t, const std::string&) {}
 	void eventBusConnected(HubApps::HubConnectionState state);
 
 	std::recursive_mutex m_dispLock;
 	PmConfig::Postmarks m_cfg;
-	void configure(const std::string& cfgStr);
+	static std::unique_ptr<PmConfig::Postmarks> parseConfig(const std::string& cfgStr);
+	void configure(const std::string& cfgStr, StartupTimes* times = nullptr);
 	bool haveCfg = false;
 	void assignPostmark(const std::string& req);
 	bool getStoredPostmark(postmarks::pmRsp& rsp);
-	bool updStoredPostmark(postmarks::pmRsp& rsp);
+	bool lookup(const std::string& devId, uint32_t& pm); // as getStoredPostmark
+	void updStoredPostmark(const postmarks::pmRsp& rsp, int64_t rangeId);
+	void releasePostmarks(const std::string& req);
+	void unassign(const std::string& devId, uint32_t pm); // takes back what the device holds in memory
+	void releaseDevice(const std::string& devId, uint32_t pm, PmWriter::Release& rel);
+	void queryPostmarks(const std::string& req);
 
 	typedef Nmrh::NumericRangeHandler<uint32_t> Postmarks_t;
-	typedef std::vector<std::pair<std::regex, Postmarks_t> > regex_pm_t;
+	struct PmRange
+	{
+		std::regex regex;
+		Postmarks_t::View postmarks; // This range's window onto m_used
+		int64_t id; // Stable hash of regex, from and to. Stored with each assignment
+	};
+	typedef std::vector<PmRange> regex_pm_t;
 	regex_pm_t m_postmarks;
+	Postmarks_t m_used; // Every postmark in use, whichever range it was assigned from
+	PmIndex m_index; // Who holds each of m_used. Changed alongside it, off when the cache bounds memory
+	PmCache m_cache; // Recent lookups in front of the store, when configured
+	static size_t cacheBudget(const PmConfig::Postmarks& cfg);
+	static PmStore::Options storeOptions(const PmConfig::Postmarks& cfg);
+
+	// Reconfiguration builds a new regex_pm_t off to the side and reconciles a
+	// snapshot of the db against it. Assignments made while that is in progress
+	// are recorded here and reconciled too just before the new ranges are
+	// swapped in.
+	struct PmChange
+	{
+		std::string devId;
+		uint32_t oldPm;
+		uint32_t newPm;
+		int64_t rangeId;
+	};
+	std::mutex m_cfgLk; // Serialises reconfiguration
+	bool m_reconfiguring = false;
+	std::vector<PmChange> m_cfgChanges;
+
+	// Result of reconciling the db against a new config
+	struct PmTag
+	{
+		std::string devId;
+		uint32_t pm;
+		int64_t rangeId;
+	};
+	struct PmReload
+	{
+		std::map<std::string, uint32_t> rejected; // no longer fit any range. Released at the swap
+		std::vector<PmTag> retag; // governing range changed or was never recorded
+	};
+
+	static int64_t rangeId(const PmConfig::Range& r);
+	void buildRanges(const PmConfig::Postmarks& cfg, regex_pm_t& postmarks);
+	static size_t matchRange(const regex_pm_t& postmarks, const std::string& devId, uint32_t pm);
+	bool loadPostmarks(PmStore& store, const regex_pm_t& postmarks, Postmarks_t* used, PmIndex* index, PmCache* cache, PmReload& reload, StartupTimes* times = nullptr);
+	static void reconcile(const regex_pm_t& postmarks, const std::string& devId, uint32_t pm, PmReload& reload);
+	void commitReload(const PmReload& reload);
+	void replayChange(const regex_pm_t& postmarks, const std::set<int64_t>& ids, const PmChange& c, PmReload& reload);
+
+	Logging::LogFile& m_log;
+	std::unique_ptr<PmStore> m_store; // Reads only. All writes go through m_writer
+
+	// Assignments queued for the writer but not yet committed, and releases as
+	// MAX_N. The allocator is the authority, so lookups check here before the db
+	std::unordered_map<std::string, std::pair<uint32_t, int64_t> > m_unwritten;
+	PmWriter m_writer;
+	void postmarkWritten(const PmWriter::Record& r, bool ok);
+
+	// Leases. Only devices in a range with a lease are tracked. Each has one
+	// live entry in the wheel, for when it would expire if not seen since;
+	// entries left behind by a reassignment are told apart by gen
+	struct Lease
+	{
+		uint32_t pm;
+		int64_t rangeId;
+		int64_t lastSeen; // seconds since the epoch
+		uint32_t gen;
+	};
+	std::map<int64_t, int64_t> m_leaseCfg; // range id -> lease in seconds
+	std::unordered_map<std::string, Lease> m_leases;
+	Tmw::TimerWheel<std::pair<std::string, uint32_t> > m_expiry;
+	uint32_t m_leaseGen = 0;
+	std::unordered_map<std::string, int64_t> m_seen; // last seen times not yet flushed, for every device while leasing or sweeping
+	std::unordered_map<std::string, int64_t> m_seenFlushed; // the last flush, which may not be in the store yet
+	int64_t m_nextFlush = 0;
+	static int64_t epochNow();
+	int64_t leaseOf(int64_t rangeId) const;
+	void trackLease(const std::string& devId, uint32_t pm, int64_t rangeId, int64_t now);
+	void loadLeases(const PmReload& reload, bool keep);
+	void reclaimExpired(int64_t now);
+	void flushSeen();
+
+	// Housekeeping runs on the dispatcher once a second. At most one tick is
+	// ever queued, so a busy dispatcher never has them pile up
+	std::thread m_ticker;
+	std::mutex m_tickLk;
+	std::condition_variable m_tickCv;
+	bool m_ticking = false;
+	std::atomic<bool> m_tickQueued{false};
+	void tickerRun();
+
+	// Where the time goes on the way from receiveEvent() to sendMsg(). Write
+	// is queued to durable, the rest are as named
+	enum Stage { Queue, Parse, Lock, Lookup, Match, Store, Write, Serialize, Publish, STAGES };
+	LatencyHistogram m_latency[STAGES];
+	int64_t m_nextLatencyDump = 0;
+	void dumpLatency(bool reset);
+
+	// Inbound traffic being captured, see record()
+	BusRecorder m_recorder;
+	bool m_connect = true; // started with the hub
+	void recordEvent(const PubSub::Message& msg, std::chrono::steady_clock::time_point at);
+
+	// Per request stage times, for dumpTrace()
+	TraceRing m_trace;
+	static_assert(STAGES <= TraceRing::STAGES, "TraceRing has a slot per stage");
+	void timed(Stage s, std::chrono::steady_clock::duration d);
 
-	sqlite3* m_pmdb;
+	// Status.Postmarks. Counters are since start, rates worked out per interval
+	std::atomic<uint64_t> m_requests{0};
+	std::atomic<uint64_t> m_lookups{0};
+	std::atomic<uint64_t> m_lookupHits{0}; // answered without going to the store
+	int64_t m_statusInterval = 0; // seconds, 0 for none. Under m_lk
+	int64_t m_nextStatus = 0;
+	uint64_t m_statusRequests = 0;
+	std::chrono::steady_clock::time_point m_statusAt;
+	void publishStatus();
+
+	// Sweeper. Walks the store a chunk at a time whenever the dispatcher has
+	// nothing else to do, and reclaims devices not seen for m_sweepAge at no
+	// more than m_sweepRate a second
+	struct Stale
+	{
+		std::string devId;
+		uint32_t pm;
+	};
+	std::atomic<int> m_inflight{0}; // bus messages queued or being handled
+	std::atomic<bool> m_sweepQueued{false};
+	int64_t m_sweepAge = 0; // seconds, 0 when off. These three under m_lk
+	size_t m_sweepChunk = 0;
+	double m_sweepRate = 0;
+	std::mutex m_sweepLk; // The rest are only touched by a sweep step
+	PmStore* m_sweepStore = nullptr;
+	PmStore::Cursor m_sweepCursor;
+	std::vector<Stale> m_sweepDue; // found stale, waiting on the rate limit
+	double m_sweepTokens = 0;
+	std::chrono::steady_clock::time_point m_sweepRefill;
+	int64_t m_nextSweep = 0;
+	size_t m_swept = 0;
+	bool sweep();
 
 public:
-	explicit Postmarks(Logging::LogFile& log, const std::string& psubAddr = "127.0.0.1");
+	struct Tick {};
+
+	// A bus message and when it arrived
+	struct Received
+	{
+		PubSub::Message msg;
+		std::chrono::steady_clock::time_point at;
+	};
+	struct SweepStep {};
+
+	// workers is how many threads the dispatcher runs messages on
+	explicit Postmarks(Logging::LogFile& log, const std::string& psubAddr = "127.0.0.1", int workers = 2);
 	~Postmarks();
 
-	bool start();
+	// Without connecting, messages only come from replay()
+	bool start(bool connect = true);
 	void stop();
 
 	static constexpr const char* appName() { return "Postmarks"; }
 	constexpr std::string& version() const { return g_version; }
 
+	// Offline bulk transfer for migrating or seeding a site, with the daemon
+	// not started. cfgStr is the config normally received on CFG.Postmarks
+	bool exportPostmarks(const std::string& cfgStr, const std::string& file);
+	bool importPostmarks(const std::string& cfgStr, const std::string& file);
+
+	// Current counters, gauges and stage histograms in the Prometheus text
+	// exposition format. Safe from any thread
+	void metrics(std::ostream& os);
+
+	// Requests through each stage of the request path and the time spent in
+	// it since start, in Stage order. Safe from any thread
+	struct StageTotal
+	{
+		const char* name;
+		uint64_t count;
+		double seconds;
+	};
+	std::vector<StageTotal> stageTotals() const;
+
+	// Writes out the last TraceRing::SLOTS requests and responses for offline
+	// analysis. Safe from any thread
+	bool dumpTrace(const std::string& file);
+
+	// Captures every inbound message to file until stop(). Best started before
+	// start() so the recording holds the configuration
+	bool record(const std::string& file);
+
+	// Feeds a recording through the dispatcher as if it had come off the bus,
+	// at the pace it was recorded or as fast as it is taken. A non empty cfgStr
+	// stands in for any configuration in the recording. Returns once every
+	// message has been handled
+	bool replay(const std::string& file, bool paced, const std::string& cfgStr = std::string());
+
+	// Takes cfgStr as on startup with every phase timed, for benchmarking. Only
+	// a startup when nothing has been configured yet
+	bool configureTimed(const std::string& cfgStr, StartupTimes& times);
+
+	// The range id stored with each assignment, for tools that write a db
+	static int64_t rangeId(const std::string& regex, uint32_t from, uint32_t to);
+
+	void processMsg(Received&& r);
 	void processMsg(PubSub::Message&& m);
 	void processMsg(const postmarks::pmRsp& rsp);
+	void processMsg(const std::shared_ptr<PmWriter::Release>& rel);
+	void processMsg(const Tick& tick);
+	void processMsg(const SweepStep& step);
 };
 
@@ -0,0 +1,159 @@
+#include "Recording.h"
+
+namespace
+{
+	void putLE(std::string& buf, uint64_t v, int bytes)
+	{
+		for (int i = 0; i < bytes; ++i)
+			buf.push_back((char)((v >> (i * 8)) & 0xff));
+	}
+
+	uint64_t getLE(const unsigned char* p, int bytes)
+	{
+		uint64_t v = 0;
+		for (int i = 0; i < bytes; ++i)
+			v |= (uint64_t)p[i] << (i * 8);
+		return v;
+	}
+
+	void putVarint(std::string& buf, uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			buf.push_back((char)(v | 0x80));
+			v >>= 7;
+		}
+		buf.push_back((char)v);
+	}
+
+	const size_t HDR_LEN = 4 + 4 + 8;
+}
+
+BusRecorder::~BusRecorder()
+{
+	close();
+}
+
+bool BusRecorder::open(const std::string& file)
+{
+	close();
+
+	std::lock_guard<std::mutex> lk(m_lk);
+	m_f = std::fopen(file.c_str(), "wb");
+	if (!m_f)
+		return false;
+
+	// Written out in large blocks rather than a message at a time
+	std::setvbuf(m_f, nullptr, _IOFBF, 1 << 20);
+
+	m_last = std::chrono::steady_clock::now();
+	int64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	m_buf.clear();
+	putLE(m_buf, MAGIC, 4);
+	putLE(m_buf, VERSION, 4);
+	putLE(m_buf, (uint64_t)epoch, 8);
+	std::fwrite(m_buf.data(), 1, m_buf.size(), m_f);
+	m_count = 0;
+	m_open = true;
+	return true;
+}
+
+void BusRecorder::close()
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	m_open = false;
+	if (m_f)
+		std::fclose(m_f);
+	m_f = nullptr;
+}
+
+void BusRecorder::write(uint8_t kind, std::chrono::steady_clock::time_point at, const std::string& payload)
+{
+	std::lock_guard<std::mutex> lk(m_lk);
+	if (!m_f)
+		return;
+
+	// Messages can be stamped out of order by a hair when more than one
+	// thread receives, so the delta never goes negative
+	int64_t delta = std::chrono::duration_cast<std::chrono::nanoseconds>(at - m_last).count();
+	if (delta < 0)
+		delta = 0;
+	else
+		m_last = at;
+
+	m_buf.clear();
+	m_buf.push_back((char)kind);
+	putVarint(m_buf, (uint64_t)delta);
+	putVarint(m_buf, payload.size());
+	std::fwrite(m_buf.data(), 1, m_buf.size(), m_f);
+	std::fwrite(payload.data(), 1, payload.size(), m_f);
+	++m_count;
+}
+
+BusRecording::~BusRecording()
+{
+	close();
+}
+
+bool BusRecording::open(const std::string& file)
+{
+	close();
+
+	m_f = std::fopen(file.c_str(), "rb");
+	if (!m_f)
+		return false;
+
+	unsigned char hdr[HDR_LEN];
+	if (std::fread(hdr, 1, HDR_LEN, m_f) != HDR_LEN || getLE(hdr, 4) != BusRecorder::MAGIC || getLE(hdr + 4, 4) != BusRecorder::VERSION)
+	{
+		close();
+		return false;
+	}
+
+	m_started = (int64_t)getLE(hdr + 8, 8);
+	m_at = 0;
+	return true;
+}
+
+void BusRecording::close()
+{
+	if (m_f)
+		std::fclose(m_f);
+	m_f = nullptr;
+}
+
+bool BusRecording::varint(uint64_t& v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int c = std::fgetc(m_f);
+		if (c == EOF)
+			return false;
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool BusRecording::next(Entry& e)
+{
+	if (!m_f)
+		return false;
+
+	int kind = std::fgetc(m_f);
+	uint64_t delta, len;
+	if (kind == EOF || !varint(delta) || !varint(len) || len > BusRecorder::MAX_PAYLOAD)
+		return false;
+
+	e.payload.resize(len);
+	if (len && std::fread(&e.payload[0], 1, len, m_f) != len)
+		return false;
+
+	m_at += (int64_t)delta;
+	e.kind = (uint8_t)kind;
+	e.at = m_at;
+	return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// Inbound bus traffic kept in a file so a run can be replayed offline. Each
+// message is stored as which subscription it arrived on, the time since the
+// one before and its payload, so a recording is barely bigger than the
+// payloads themselves.
+//
+// "PMBR", version, start time in ns since the epoch, then per message: kind
+// byte, delta ns and payload length as LEB128, payload. A torn tail is
+// dropped on reading.
+class BusRecorder
+{
+public:
+	BusRecorder() {}
+	~BusRecorder();
+
+	bool open(const std::string& file);
+	void close();
+	bool isOpen() const { return m_open; }
+
+	void write(uint8_t kind, std::chrono::steady_clock::time_point at, const std::string& payload);
+
+	uint64_t count() const { return m_count; }
+
+	static const uint32_t MAGIC = 0x52424d50; // "PMBR"
+	static const uint32_t VERSION = 1;
+	static const uint64_t MAX_PAYLOAD = 1 << 26; // anything longer is damage
+
+private:
+	std::mutex m_lk;
+	std::FILE* m_f = nullptr;
+	std::atomic<bool> m_open{false}; // checked on every message without the lock
+	std::chrono::steady_clock::time_point m_last;
+	std::atomic<uint64_t> m_count{0};
+	std::string m_buf;
+};
+
+class BusRecording
+{
+public:
+	struct Entry
+	{
+		uint8_t kind;
+		int64_t at; // ns from the start of the recording
+		std::string payload;
+	};
+
+	BusRecording() {}
+	~BusRecording();
+
+	bool open(const std::string& file);
+	void close();
+
+	// False at the end, or at a torn record
+	bool next(Entry& e);
+
+	int64_t started() const { return m_started; } // ns since the epoch
+
+private:
+	std::FILE* m_f = nullptr;
+	int64_t m_started = 0;
+	int64_t m_at = 0;
+
+	bool varint(uint64_t& v);
+};
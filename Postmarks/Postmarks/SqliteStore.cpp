@@ -0,0 +1,549 @@
+#include "SqliteStore.h"
+#include "Postmarks.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
+#include <limits>
+#include <vector>
+
+SqliteStore::SqliteStore(Logging::LogFile& log, bool keyByHash)
+	: Logging::LogClient(log)
+	, m_keyByHash(keyByHash)
+{
+}
+
+SqliteStore::~SqliteStore()
+{
+	close();
+}
+
+int64_t SqliteStore::devHash(const std::string& devId)
+{
+	// FNV-1a. Persisted as the key so must not change between releases
+	uint64_t h = 14695981039346656037ULL;
+	for (char c : devId)
+	{
+		h ^= (uint8_t)c;
+		h *= 1099511628211ULL;
+	}
+	return (int64_t)h;
+}
+
+bool SqliteStore::exec(sqlite3* db, const char* sql, const char* what)
+{
+	char* err = nullptr;
+	if (sqlite3_exec(db, sql, nullptr, nullptr, &err) == SQLITE_OK)
+		return true;
+
+	LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error " << what << ": " << err);
+	sqlite3_free(err);
+	return false;
+}
+
+bool SqliteStore::createSchema(sqlite3* db)
+{
+	// Keyed by pm with a unique index on the device text, as it always was
+	static const char* CREATE = "CREATE TABLE IF NOT EXISTS postmarks (pm INTEGER PRIMARY KEY, device TEXT UNIQUE, range_id INTEGER, last_seen INTEGER)";
+
+	// Or, once opted into, keyed by device hash so a lookup is one seek in one
+	// b-tree and the device text is stored once. The device is part of the key
+	// so devices whose hashes collide are both kept
+	static const char* CREATE_HASHED = "CREATE TABLE IF NOT EXISTS postmarks (dev_hash INTEGER NOT NULL, device TEXT NOT NULL, "
+		"pm INTEGER NOT NULL, range_id INTEGER, last_seen INTEGER, PRIMARY KEY (dev_hash, device)) WITHOUT ROWID";
+
+	bool exists = false, haveHash = false, haveRangeId = false, haveLastSeen = false;
+	sqlite3_stmt* stmt;
+	sqlite3_prepare_v2(db, "PRAGMA table_info(postmarks)", -1, &stmt, nullptr);
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		std::string col((const char*)sqlite3_column_text(stmt, 1));
+		exists = true;
+		haveHash |= col == "dev_hash";
+		haveRangeId |= col == "range_id";
+		haveLastSeen |= col == "last_seen";
+	}
+	sqlite3_finalize(stmt);
+
+	// A table already keyed by hash stays that way whatever the config says
+	m_hashed = haveHash || (!exists && m_keyByHash);
+
+	// Databases from before the governing range was recorded get the column
+	// added. Their rows are tagged the first time they are reconciled
+	if (exists && !haveRangeId)
+	{
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Adding range_id to postmarks table");
+		if (!exec(db, "ALTER TABLE postmarks ADD COLUMN range_id INTEGER", "migrating tables"))
+			return false;
+	}
+
+	// Devices in a db from before leases count as seen when first loaded
+	if (exists && !haveLastSeen)
+	{
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Adding last_seen to postmarks table");
+		if (!exec(db, "ALTER TABLE postmarks ADD COLUMN last_seen INTEGER", "migrating tables"))
+			return false;
+	}
+
+	// Copied across once, in one transaction, only when configured to
+	if (exists && !haveHash && m_keyByHash)
+	{
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Migrating postmarks table to be keyed by device hash");
+
+		sqlite3_create_function(db, "pm_devhash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr,
+			[](sqlite3_context* ctx, int, sqlite3_value** v)
+			{
+				const char* dev = (const char*)sqlite3_value_text(v[0]);
+				sqlite3_result_int64(ctx, devHash(std::string(dev ? dev : "", sqlite3_value_bytes(v[0]))));
+			}, nullptr, nullptr);
+
+		std::string create = std::string(CREATE_HASHED);
+		create.replace(create.find("postmarks "), 10, "postmarks_new ");
+
+		bool ok = exec(db, "BEGIN", "migrating tables")
+			&& exec(db, create.c_str(), "migrating tables")
+			&& exec(db, "INSERT INTO postmarks_new (dev_hash, device, pm, range_id, last_seen) "
+				"SELECT pm_devhash(device), device, pm, range_id, last_seen FROM postmarks WHERE device IS NOT NULL", "migrating tables");
+
+		int64_t before = 0, after = 0;
+		if (ok)
+		{
+			sqlite3_prepare_v2(db, "SELECT (SELECT COUNT(*) FROM postmarks), (SELECT COUNT(*) FROM postmarks_new)", -1, &stmt, nullptr);
+			if (sqlite3_step(stmt) == SQLITE_ROW)
+			{
+				before = sqlite3_column_int64(stmt, 0);
+				after = sqlite3_column_int64(stmt, 1);
+			}
+			sqlite3_finalize(stmt);
+		}
+
+		ok = ok && exec(db, "DROP TABLE postmarks", "migrating tables")
+			&& exec(db, "ALTER TABLE postmarks_new RENAME TO postmarks", "migrating tables")
+			&& exec(db, "COMMIT", "migrating tables");
+
+		sqlite3_create_function(db, "pm_devhash", 1, SQLITE_UTF8, nullptr, nullptr, nullptr, nullptr);
+
+		if (!ok)
+		{
+			sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+			return false;
+		}
+
+		if (after != before)
+			LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Dropped " << before - after << " postmarks with no device during migration");
+		LOG(Logging::LL_Info, Logging::LC_Postmarks, "Migrated " << after << " postmarks");
+		m_hashed = true;
+	}
+
+	if (!m_hashed)
+		return exec(db, CREATE, "creating tables")
+			&& exec(db, "CREATE INDEX IF NOT EXISTS postmarks_range ON postmarks (range_id)", "creating index");
+
+	// pm is no longer the key, so without this every upsert scans the table
+	// for the row it takes the postmark from. On 1M devices it is 28MB of an
+	// 85MB file, and an upsert takes 31us with it against 58ms without
+	return exec(db, CREATE_HASHED, "creating tables")
+		&& exec(db, "CREATE UNIQUE INDEX IF NOT EXISTS postmarks_pm ON postmarks (pm)", "creating index")
+		&& exec(db, "CREATE INDEX IF NOT EXISTS postmarks_range ON postmarks (range_id)", "creating index");
+}
+
+bool SqliteStore::open(const std::string& location)
+{
+	close();
+
+	scheme(location, m_file);
+
+	if (sqlite3_open(m_file.c_str(), &m_write))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open database: " << sqlite3_errmsg(m_write));
+		close();
+		return false;
+	}
+
+	if (!createSchema(m_write))
+	{
+		close();
+		return false;
+	}
+
+	// WAL lets lookups and the reconfiguration scan read a consistent snapshot
+	// on their own connections without blocking the writer. A commit is only
+	// acknowledged once it is on disk
+	sqlite3_exec(m_write, "PRAGMA journal_mode=WAL", nullptr, nullptr, nullptr);
+	sqlite3_exec(m_write, "PRAGMA synchronous=FULL", nullptr, nullptr, nullptr);
+	sqlite3_busy_timeout(m_write, 5000);
+
+	// Parameters are numbered the same in both layouts: ?1 dev_hash, ?2
+	// device, ?3 pm, ?4 range_id, ?5 last_seen. The keyed by pm layout has no
+	// use for the hash
+	//
+	// The in-memory allocator is the authority, so whatever row held this
+	// device or this postmark before is simply replaced
+	if (m_hashed)
+	{
+		sqlite3_prepare_v2(m_write, "DELETE FROM postmarks WHERE pm = ?3 AND NOT (dev_hash = ?1 AND device = ?2)", -1, &m_steal, nullptr);
+		sqlite3_prepare_v2(m_write, "INSERT INTO postmarks (dev_hash, device, pm, range_id) VALUES (?1, ?2, ?3, ?4) "
+			"ON CONFLICT (dev_hash, device) DO UPDATE SET pm = excluded.pm, range_id = excluded.range_id", -1, &m_upsert, nullptr);
+		sqlite3_prepare_v2(m_write, "DELETE FROM postmarks WHERE dev_hash = ?1 AND device = ?2", -1, &m_delete, nullptr);
+		sqlite3_prepare_v2(m_write, "UPDATE postmarks SET range_id = ?4 WHERE dev_hash = ?1 AND device = ?2 AND pm = ?3", -1, &m_retag, nullptr);
+		sqlite3_prepare_v2(m_write, "UPDATE postmarks SET last_seen = ?5 WHERE dev_hash = ?1 AND device = ?2", -1, &m_touch, nullptr);
+	}
+	else
+	{
+		sqlite3_prepare_v2(m_write, "INSERT OR REPLACE INTO postmarks (pm, device, range_id) VALUES (?3, ?2, ?4)", -1, &m_upsert, nullptr);
+		sqlite3_prepare_v2(m_write, "DELETE FROM postmarks WHERE device = ?2", -1, &m_delete, nullptr);
+		sqlite3_prepare_v2(m_write, "UPDATE postmarks SET range_id = ?4 WHERE device = ?2 AND pm = ?3", -1, &m_retag, nullptr);
+		sqlite3_prepare_v2(m_write, "UPDATE postmarks SET last_seen = ?5 WHERE device = ?2", -1, &m_touch, nullptr);
+	}
+
+	if (sqlite3_open_v2(m_file.c_str(), &m_read, SQLITE_OPEN_READONLY, nullptr))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open database for reading: " << sqlite3_errmsg(m_read));
+		close();
+		return false;
+	}
+	sqlite3_busy_timeout(m_read, 1000);
+
+	// pm is the key, or has a unique index when it isn't
+	sqlite3_prepare_v2(m_read, "SELECT device, pm FROM postmarks WHERE pm BETWEEN ?1 AND ?2 ORDER BY pm LIMIT ?3", -1, &m_held, nullptr);
+
+	// A scan walks the table in key order, the cursor being the last column
+	if (m_hashed)
+	{
+		sqlite3_prepare_v2(m_read, "SELECT pm FROM postmarks WHERE dev_hash = ?1 AND device = ?2", -1, &m_get, nullptr);
+		sqlite3_prepare_v2(m_read, "SELECT pm, device, range_id, last_seen, dev_hash FROM postmarks WHERE dev_hash BETWEEN ?1 AND ?3 "
+			"ORDER BY dev_hash LIMIT ?2", -1, &m_scan, nullptr);
+	}
+	else
+	{
+		sqlite3_prepare_v2(m_read, "SELECT pm FROM postmarks WHERE device = ?2", -1, &m_get, nullptr);
+		sqlite3_prepare_v2(m_read, "SELECT pm, device, range_id, last_seen, pm FROM postmarks WHERE pm BETWEEN ?1 AND ?3 "
+			"ORDER BY pm LIMIT ?2", -1, &m_scan, nullptr);
+	}
+
+	return true;
+}
+
+void SqliteStore::close()
+{
+	backupAbort();
+
+	sqlite3_finalize(m_get);
+	sqlite3_finalize(m_scan);
+	sqlite3_finalize(m_held);
+	sqlite3_finalize(m_upsert);
+	sqlite3_finalize(m_delete);
+	sqlite3_finalize(m_retag);
+	sqlite3_finalize(m_steal);
+	sqlite3_finalize(m_touch);
+	m_get = m_scan = m_held = m_upsert = m_delete = m_retag = m_steal = m_touch = nullptr;
+
+	sqlite3_close(m_read);
+	sqlite3_close(m_write);
+	m_read = m_write = nullptr;
+}
+
+void SqliteStore::bindDevice(sqlite3_stmt* stmt, const std::string& devId)
+{
+	sqlite3_bind_int64(stmt, 1, devHash(devId));
+	sqlite3_bind_text(stmt, 2, devId.c_str(), devId.size(), SQLITE_STATIC);
+}
+
+bool SqliteStore::get(const std::string& devId, uint32_t& pm)
+{
+	std::lock_guard<std::mutex> lk(m_readLk);
+
+	bool found = false;
+	bindDevice(m_get, devId);
+	switch (sqlite3_step(m_get))
+	{
+	case SQLITE_ROW:
+		pm = sqlite3_column_int64(m_get, 0);
+		found = true;
+		break;
+	case SQLITE_DONE:
+		break;
+	default:
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error reading postmark for " << devId << ": " << sqlite3_errmsg(m_read));
+		break;
+	}
+	sqlite3_reset(m_get);
+
+	return found;
+}
+
+bool SqliteStore::held(uint32_t from, uint32_t to, size_t limit, Held& out)
+{
+	std::lock_guard<std::mutex> lk(m_readLk);
+
+	// One more than asked for says whether more follow
+	size_t n = 0;
+	int rc;
+	sqlite3_bind_int64(m_held, 1, from);
+	sqlite3_bind_int64(m_held, 2, to);
+	sqlite3_bind_int64(m_held, 3, limit + 1);
+	while ((rc = sqlite3_step(m_held)) == SQLITE_ROW && n++ < limit)
+		out.push_back({ (const char*)sqlite3_column_text(m_held, 0), (uint32_t)sqlite3_column_int64(m_held, 1) });
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error reading postmarks " << from << " to " << to << ": " << sqlite3_errmsg(m_read));
+	sqlite3_reset(m_held);
+
+	return rc == SQLITE_ROW;
+}
+
+bool SqliteStore::load(const std::string& where, RowFn fn)
+{
+	sqlite3* db = nullptr;
+	if (sqlite3_open_v2(m_file.c_str(), &db, SQLITE_OPEN_READONLY, nullptr))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open database for reading: " << sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return false;
+	}
+	sqlite3_busy_timeout(db, 1000);
+
+	int rc;
+	sqlite3_stmt* stmt;
+	std::string sql = "SELECT pm, device, range_id, last_seen FROM postmarks" + where;
+	sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		bool tagged = sqlite3_column_type(stmt, 2) != SQLITE_NULL;
+		fn(std::string((const char*)sqlite3_column_text(stmt, 1)), (uint32_t)sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 2), tagged,
+			sqlite3_column_int64(stmt, 3));
+	}
+
+	bool ok = rc == SQLITE_DONE;
+	if (!ok)
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error reading postmarks: " << sqlite3_errmsg(db));
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return ok;
+}
+
+bool SqliteStore::loadAll(RowFn fn)
+{
+	return load("", fn);
+}
+
+bool SqliteStore::loadUnknown(const std::set<int64_t>& ranges, RowFn fn)
+{
+	std::stringstream ids;
+	for (int64_t id : ranges)
+		ids << (ids.tellp() ? "," : "") << id;
+
+	return load(" WHERE range_id IS NULL OR range_id NOT IN (" + ids.str() + ")", fn);
+}
+
+bool SqliteStore::scan(Cursor& cursor, size_t limit, RowFn fn)
+{
+	// In key order, so each chunk is a short range of the table. The cursor
+	// is the key to carry on from
+	struct Row
+	{
+		std::string devId;
+		uint32_t pm;
+		int64_t rangeId;
+		bool tagged;
+		int64_t lastSeen;
+		int64_t key;
+	};
+	std::vector<Row> rows;
+	rows.reserve(limit);
+
+	if (!cursor.started)
+		cursor.pos = std::numeric_limits<int64_t>::min();
+	cursor.started = true;
+
+	int rc;
+	bool last;
+	{
+		std::lock_guard<std::mutex> lk(m_readLk);
+
+		auto read = [&](int64_t from, int64_t to, int64_t n)
+		{
+			sqlite3_bind_int64(m_scan, 1, from);
+			sqlite3_bind_int64(m_scan, 2, n);
+			sqlite3_bind_int64(m_scan, 3, to);
+			while ((rc = sqlite3_step(m_scan)) == SQLITE_ROW)
+				rows.push_back({ (const char*)sqlite3_column_text(m_scan, 1), (uint32_t)sqlite3_column_int64(m_scan, 0), sqlite3_column_int64(m_scan, 2),
+					sqlite3_column_type(m_scan, 2) != SQLITE_NULL, sqlite3_column_int64(m_scan, 3), sqlite3_column_int64(m_scan, 4) });
+			if (rc != SQLITE_DONE)
+				LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error scanning postmarks: " << sqlite3_errmsg(m_read));
+			sqlite3_reset(m_scan);
+		};
+
+		read(cursor.pos, std::numeric_limits<int64_t>::max(), limit);
+		last = rows.size() < limit;
+
+		// Devices sharing a hash may straddle the end of a full chunk. They are
+		// left for the next one to read together, or if they are all this one
+		// has the rest of them are read now
+		if (!last)
+		{
+			int64_t key = rows.back().key;
+			if (rows.front().key != key)
+			{
+				while (rows.back().key == key)
+					rows.pop_back();
+			}
+			else
+			{
+				rows.clear();
+				read(key, key, -1);
+			}
+		}
+	}
+
+	if (!rows.empty())
+	{
+		int64_t key = rows.back().key;
+		last = last || key == std::numeric_limits<int64_t>::max();
+		cursor.pos = key + (last ? 0 : 1);
+	}
+
+	cursor.done = rc == SQLITE_DONE && last;
+
+	// Outside the lock so lookups are not held up by whatever fn does
+	for (const Row& r : rows)
+		fn(r.devId, r.pm, r.rangeId, r.tagged, r.lastSeen);
+
+	return rc == SQLITE_DONE;
+}
+
+bool SqliteStore::begin()
+{
+	return sqlite3_exec(m_write, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
+bool SqliteStore::step(sqlite3_stmt* stmt, const std::string& devId)
+{
+	bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+	if (!ok)
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error writing postmark for " << devId << ": " << sqlite3_errmsg(m_write));
+	sqlite3_reset(stmt);
+	return ok;
+}
+
+bool SqliteStore::upsert(const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	if (m_steal)
+	{
+		bindDevice(m_steal, devId);
+		sqlite3_bind_int64(m_steal, 3, pm);
+		if (!step(m_steal, devId))
+			return false;
+	}
+
+	bindDevice(m_upsert, devId);
+	sqlite3_bind_int64(m_upsert, 3, pm);
+	sqlite3_bind_int64(m_upsert, 4, rangeId);
+	return step(m_upsert, devId);
+}
+
+bool SqliteStore::remove(const std::string& devId)
+{
+	bindDevice(m_delete, devId);
+	return step(m_delete, devId);
+}
+
+bool SqliteStore::retag(const std::string& devId, uint32_t pm, int64_t rangeId)
+{
+	bindDevice(m_retag, devId);
+	sqlite3_bind_int64(m_retag, 3, pm);
+	sqlite3_bind_int64(m_retag, 4, rangeId);
+	return step(m_retag, devId);
+}
+
+bool SqliteStore::touch(const std::string& devId, int64_t lastSeen)
+{
+	bindDevice(m_touch, devId);
+	sqlite3_bind_int64(m_touch, 5, lastSeen);
+	return step(m_touch, devId);
+}
+
+bool SqliteStore::commit()
+{
+	if (sqlite3_exec(m_write, "COMMIT", nullptr, nullptr, nullptr) == SQLITE_OK)
+		return true;
+
+	LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error committing postmarks: " << sqlite3_errmsg(m_write));
+	sqlite3_exec(m_write, "ROLLBACK", nullptr, nullptr, nullptr);
+	return false;
+}
+
+bool SqliteStore::backupStart(const std::string& path)
+{
+	backupAbort();
+
+	// Copied to the side and renamed when complete, so the last good backup
+	// is never half overwritten
+	m_backupPath = path;
+	std::string tmp = path + ".tmp";
+	std::error_code ec;
+	std::filesystem::remove(tmp, ec);
+
+	if (sqlite3_open(tmp.c_str(), &m_backupDb))
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't open backup " << tmp << ": " << sqlite3_errmsg(m_backupDb));
+		backupAbort();
+		return false;
+	}
+
+	m_backup = sqlite3_backup_init(m_backupDb, "main", m_write, "main");
+	if (!m_backup)
+	{
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't start backup to " << tmp << ": " << sqlite3_errmsg(m_backupDb));
+		backupAbort();
+		return false;
+	}
+
+	return true;
+}
+
+int SqliteStore::backupStep(int pages)
+{
+	if (!m_backup)
+		return -1;
+
+	int rc = sqlite3_backup_step(m_backup, pages);
+	if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+		return std::max(sqlite3_backup_remaining(m_backup), 1);
+
+	sqlite3_backup_finish(m_backup);
+	m_backup = nullptr;
+
+	std::error_code ec;
+	if (rc == SQLITE_DONE)
+	{
+		sqlite3_close(m_backupDb);
+		m_backupDb = nullptr;
+
+		std::filesystem::rename(m_backupPath + ".tmp", m_backupPath, ec);
+		if (!ec)
+			return 0;
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Can't move backup into place at " << m_backupPath << ": " << ec.message());
+	}
+	else
+		LOG(Logging::LL_Warning, Logging::LC_Postmarks, "Error backing up to " << m_backupPath << ": " << sqlite3_errmsg(m_backupDb));
+
+	backupAbort();
+	return -1;
+}
+
+void SqliteStore::backupAbort()
+{
+	if (m_backup)
+		sqlite3_backup_finish(m_backup);
+	m_backup = nullptr;
+
+	if (m_backupDb)
+	{
+		sqlite3_close(m_backupDb);
+		m_backupDb = nullptr;
+
+		std::error_code ec;
+		std::filesystem::remove(m_backupPath + ".tmp", ec);
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "PmStore.h"
+#include "sqlite3.h"
+
+#include <mutex>
+
+// The postmarks table in a SQLite db file. Writes have a connection of their
+// own, lookups share another and each load opens a read-only one, so with WAL
+// none of them block the others.
+//
+// The table is keyed by pm unless the config opts into keying it by device
+// hash, which migrates an existing table once and for good.
+class SqliteStore : public PmStore, public Logging::LogClient
+{
+	std::string m_file;
+	bool m_keyByHash; // migrate the table to be keyed by device hash
+	bool m_hashed = false; // the table in use is
+
+	sqlite3* m_read = nullptr;
+	sqlite3_stmt* m_get = nullptr;
+	sqlite3_stmt* m_scan = nullptr;
+	sqlite3_stmt* m_held = nullptr;
+	std::mutex m_readLk;
+
+	sqlite3* m_write = nullptr; // Only ever used between begin() and commit()
+	sqlite3_stmt* m_upsert = nullptr;
+	sqlite3_stmt* m_delete = nullptr;
+	sqlite3_stmt* m_retag = nullptr;
+	sqlite3_stmt* m_steal = nullptr;
+	sqlite3_stmt* m_touch = nullptr;
+
+	// Backed up from m_write so writes made during the backup are carried
+	// across rather than restarting it
+	sqlite3* m_backupDb = nullptr;
+	sqlite3_backup* m_backup = nullptr;
+	std::string m_backupPath;
+
+	static int64_t devHash(const std::string& devId);
+	bool exec(sqlite3* db, const char* sql, const char* what);
+	bool createSchema(sqlite3* db);
+	void bindDevice(sqlite3_stmt* stmt, const std::string& devId);
+	bool step(sqlite3_stmt* stmt, const std::string& devId);
+	bool load(const std::string& where, RowFn fn);
+
+public:
+	explicit SqliteStore(Logging::LogFile& log, bool keyByHash = false);
+	~SqliteStore();
+
+	bool open(const std::string& location) override;
+	void close() override;
+
+	bool get(const std::string& devId, uint32_t& pm) override;
+	bool held(uint32_t from, uint32_t to, size_t limit, Held& out) override;
+
+	bool loadAll(RowFn fn) override;
+	bool loadUnknown(const std::set<int64_t>& ranges, RowFn fn) override;
+	bool scan(Cursor& cursor, size_t limit, RowFn fn) override;
+
+	bool begin() override;
+	bool upsert(const std::string& devId, uint32_t pm, int64_t rangeId) override;
+	bool remove(const std::string& devId) override;
+	bool retag(const std::string& devId, uint32_t pm, int64_t rangeId) override;
+	bool touch(const std::string& devId, int64_t lastSeen) override;
+	bool commit() override;
+
+	bool backupStart(const std::string& path) override;
+	int backupStep(int pages) override;
+	void backupAbort() override;
+};
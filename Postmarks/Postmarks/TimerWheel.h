@@ -0,0 +1,150 @@
+#if defined (_MSC_VER) && (_MSC_VER >= 1000)
+#pragma once
+#endif
+#ifndef TMW_TIMER_WHEEL_H
+#define TMW_TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+namespace Tmw
+{
+
+// Hierarchical timer wheel over whole seconds. Four levels of 64 slots, each
+// slot of a level spanning a full turn of the level below, so adding is O(1)
+// and an item is only ever moved down a level at most three times. Anything
+// further out than the top level covers is parked in its last slot and
+// re-filed when it comes round.
+//
+// advance() only moves the clock on. Due items are handed out by take() in
+// batches of whatever size the caller can afford.
+template <class T> class TimerWheel
+{
+public:
+	explicit TimerWheel(int64_t now = 0) : m_now(now), m_size(0) {}
+
+	int64_t now() const { return m_now; }
+	size_t size() const { return m_size; }
+	size_t due() const { return m_due.size(); }
+
+	void add(int64_t when, const T& item)
+	{
+		++m_size;
+		file(Entry{ when, item });
+	}
+
+	void advance(int64_t now)
+	{
+		// After a long gap or a clock jump it is cheaper to re-file everything
+		// than to turn the wheel a second at a time
+		if (now - m_now > SPAN)
+		{
+			std::vector<Entry> all;
+			for (int l = 0; l < LEVELS; ++l)
+				for (int s = 0; s < SLOTS; ++s)
+				{
+					all.insert(all.end(), m_slots[l][s].begin(), m_slots[l][s].end());
+					m_slots[l][s].clear();
+				}
+
+			m_now = now;
+			for (const Entry& e : all)
+				file(e);
+			return;
+		}
+
+		while (m_now < now)
+		{
+			++m_now;
+
+			// Bring the next turn of each level down before firing level 0
+			int l = 1;
+			while (l < LEVELS && slot(m_now, l - 1) == 0)
+				++l;
+			for (--l; l > 0; --l)
+				cascade(l);
+
+			std::vector<Entry>& s = m_slots[0][slot(m_now, 0)];
+			for (const Entry& e : s)
+				m_due.push_back(e);
+			s.clear();
+		}
+	}
+
+	// Up to max due items, oldest first. Returns how many were taken
+	size_t take(std::vector<T>& out, size_t max)
+	{
+		size_t n = 0;
+		while (n < max && !m_due.empty())
+		{
+			out.push_back(std::move(m_due.front().item));
+			m_due.pop_front();
+			++n;
+		}
+		m_size -= n;
+		return n;
+	}
+
+	void clear(int64_t now)
+	{
+		for (int l = 0; l < LEVELS; ++l)
+			for (int s = 0; s < SLOTS; ++s)
+				m_slots[l][s].clear();
+		m_due.clear();
+		m_now = now;
+		m_size = 0;
+	}
+
+private:
+	static const int BITS = 6;
+	static const int SLOTS = 1 << BITS;
+	static const int LEVELS = 4;
+	static const int64_t SPAN = (int64_t)1 << (BITS * LEVELS);
+
+	struct Entry
+	{
+		int64_t when;
+		T item;
+	};
+
+	int64_t m_now;
+	size_t m_size;
+	std::vector<Entry> m_slots[LEVELS][SLOTS];
+	std::deque<Entry> m_due;
+
+	static int slot(int64_t t, int level)
+	{
+		return (int)((t >> (BITS * level)) & (SLOTS - 1));
+	}
+
+	void file(const Entry& e)
+	{
+		int64_t delta = e.when - m_now;
+		if (delta <= 0)
+		{
+			m_due.push_back(e);
+			return;
+		}
+
+		int64_t when = delta < SPAN ? e.when : m_now + SPAN - 1;
+		int level = 0;
+		while (level < LEVELS - 1 && delta >= ((int64_t)1 << (BITS * (level + 1))))
+			++level;
+		m_slots[level][slot(when, level)].push_back(e);
+	}
+
+	void cascade(int level)
+	{
+		std::vector<Entry> s;
+		s.swap(m_slots[level][slot(m_now, level)]);
+		for (const Entry& e : s)
+			file(e);
+	}
+};
+
+} // namespace Tmw
+
+#endif // TMW_TIMER_WHEEL_H
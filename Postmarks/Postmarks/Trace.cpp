@@ -0,0 +1,130 @@
+#include "Trace.h"
+
+#include <cstdio>
+
+namespace
+{
+	void putLE(std::string& buf, uint64_t v, int bytes)
+	{
+		for (int i = 0; i < bytes; ++i)
+			buf.push_back((char)((v >> (i * 8)) & 0xff));
+	}
+}
+
+TraceRing::TraceRing()
+	: m_slots(SLOTS)
+{
+}
+
+void TraceRing::record(const Entry& e)
+{
+	uint64_t n = m_next.fetch_add(1, std::memory_order_relaxed);
+	Slot& s = m_slots[n & (SLOTS - 1)];
+
+	// Seqlock. Readers check seq either side of their copy
+	s.seq.store(n * 2 + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s.w[0].store(e.devHash, std::memory_order_relaxed);
+	s.w[1].store((uint64_t)e.at, std::memory_order_relaxed);
+	s.w[2].store((uint64_t)e.kind << 32 | e.pm, std::memory_order_relaxed);
+	for (int i = 0; i < STAGES; i += 2)
+		s.w[3 + i / 2].store((uint64_t)(i + 1 < STAGES ? e.ns[i + 1] : 0) << 32 | e.ns[i], std::memory_order_relaxed);
+
+	s.seq.store(n * 2 + 2, std::memory_order_release);
+}
+
+void TraceRing::snapshot(std::vector<Entry>& out) const
+{
+	out.clear();
+
+	uint64_t next = m_next.load(std::memory_order_acquire);
+	uint64_t first = next > SLOTS ? next - SLOTS : 0;
+	out.reserve(next - first);
+
+	for (uint64_t n = first; n < next; ++n)
+	{
+		const Slot& s = m_slots[n & (SLOTS - 1)];
+
+		// Skips a slot still being written or already reused by a later request
+		uint64_t seq = s.seq.load(std::memory_order_acquire);
+		if (seq != n * 2 + 2)
+			continue;
+
+		uint64_t w[WORDS];
+		for (int i = 0; i < WORDS; ++i)
+			w[i] = s.w[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (s.seq.load(std::memory_order_relaxed) != seq)
+			continue;
+
+		Entry e;
+		e.devHash = w[0];
+		e.at = (int64_t)w[1];
+		e.kind = (Kind)(w[2] >> 32);
+		e.pm = (uint32_t)w[2];
+		for (int i = 0; i < STAGES; ++i)
+			e.ns[i] = (uint32_t)(w[3 + i / 2] >> (i % 2 * 32));
+		out.push_back(e);
+	}
+}
+
+bool TraceRing::dump(const std::string& file, const char* const* stageNames, int stages) const
+{
+	std::vector<Entry> entries;
+	snapshot(entries);
+
+	std::string buf;
+	putLE(buf, MAGIC, 4);
+	putLE(buf, VERSION, 4);
+	putLE(buf, STAGES, 4);
+	for (int i = 0; i < STAGES; ++i)
+	{
+		if (i < stages)
+			buf.append(stageNames[i]);
+		buf.push_back('\0');
+	}
+
+	putLE(buf, entries.size(), 8);
+	for (const Entry& e : entries)
+	{
+		putLE(buf, e.devHash, 8);
+		putLE(buf, (uint64_t)e.at, 8);
+		putLE(buf, e.kind, 4);
+		putLE(buf, e.pm, 4);
+		for (int i = 0; i < STAGES; ++i)
+			putLE(buf, e.ns[i], 4);
+	}
+
+	std::FILE* f = std::fopen(file.c_str(), "wb");
+	if (!f)
+		return false;
+
+	bool ok = std::fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+	return std::fclose(f) == 0 && ok;
+}
+
+uint64_t TraceRing::hash(const std::string& devId)
+{
+	// FNV-1a. Enough to match up requests without writing device ids out
+	uint64_t h = 14695981039346656037ULL;
+	for (char c : devId)
+	{
+		h ^= (uint8_t)c;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint32_t TraceRing::nanos(std::chrono::steady_clock::duration d)
+{
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	return ns < 0 ? 0 : ns > (int64_t)UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+int64_t TraceRing::epochNanos(std::chrono::steady_clock::time_point t)
+{
+	std::chrono::system_clock::time_point wall = std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - t);
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(wall.time_since_epoch()).count();
+}
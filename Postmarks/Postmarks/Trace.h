@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The last few thousand requests, kept all the time so a latency spike can be
+// looked at after the fact. Each request is one fixed size record of stage
+// times in a ring that wraps over the oldest. Writers claim a slot with one
+// atomic add and never take a lock; a record being overwritten while it is
+// read is skipped rather than copied torn.
+class TraceRing
+{
+public:
+	static const int STAGES = 10;
+	static const size_t SLOTS = 32768; // power of two
+
+	enum Kind : uint8_t { Request = 1, Response = 2 };
+
+	struct Entry
+	{
+		uint64_t devHash = 0;
+		int64_t at = 0; // ns since the epoch the request arrived, or the response went
+		Kind kind = Request;
+		uint32_t pm = 0;
+		uint32_t ns[STAGES] = {}; // time in each stage, saturating
+	};
+
+	TraceRing();
+
+	void record(const Entry& e);
+
+	// Oldest first
+	void snapshot(std::vector<Entry>& out) const;
+
+	// Binary, little endian. "PMTR", version, stage count and stage names,
+	// record count, then the records
+	bool dump(const std::string& file, const char* const* stageNames, int stages) const;
+
+	static uint64_t hash(const std::string& devId);
+	static uint32_t nanos(std::chrono::steady_clock::duration d);
+	static int64_t epochNanos(std::chrono::steady_clock::time_point t);
+
+private:
+	static const uint32_t MAGIC = 0x52544d50; // "PMTR"
+	static const uint32_t VERSION = 1;
+	static const int WORDS = 3 + (STAGES + 1) / 2; // devHash, at, kind and pm, stages two to a word
+
+	// seq is odd while the slot is being written
+	struct Slot
+	{
+		std::atomic<uint64_t> seq{0};
+		std::atomic<uint64_t> w[WORDS];
+	};
+
+	std::vector<Slot> m_slots;
+	std::atomic<uint64_t> m_next{0};
+};
@@ -0,0 +1,317 @@
+// Drives Postmark.Request at the service end to end, with the loopback hub in
+// place of pSub, and reports throughput and latency as a client would see it:
+// from the moment a request was due to be sent to its Postmark.Response.
+//
+// Requests go out open loop at a fixed rate, so a slow service shows up as
+// latency rather than as the generator quietly slowing down. A share of them
+// come from devices that already have a postmark, and a share ask for a
+// particular one.
+
+#include "Postmarks/Postmarks.h"
+#include "Postmarks/Latency.h"
+#include "postmark-pimpl.hxx"
+#include "postmark-simpl.hxx"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace
+{
+	const PubSub::Subject PUB_CFG{ "CFG", "Postmarks" };
+	const PubSub::Subject PUB_PMREQ{ "_", "Postmark", "Request" };
+	const PubSub::Subject SUB_PMRSP{ "Postmark", "Response" };
+
+	const char* const PROBE = "loadgen-probe";
+
+	struct Options
+	{
+		double rate = 1000; // requests a second, 0 for as fast as they can be sent
+		uint64_t requests = 100000;
+		uint32_t devices = 10000; // already holding a postmark before the run
+		int returning = 50; // percent of requests from those
+		int requested = 0; // percent asking for a particular postmark
+		uint32_t rangeTo = 16777215;
+		std::string store = "memory:";
+		std::string cfgFile;
+		std::string logFile = "loadgen.log";
+		int wait = 30; // seconds for the service to answer
+		unsigned seed = 1;
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	// Requests sent and not yet answered, by device. A device can have more
+	// than one outstanding and is answered in order
+	std::mutex g_lk;
+	std::condition_variable g_cv;
+	std::unordered_map<std::string, std::deque<Clock::time_point> > g_pending;
+	uint64_t g_answered = 0;
+	uint64_t g_unassigned = 0; // answered without a postmark
+	bool g_probed = false;
+	bool g_measuring = false;
+	LatencyHistogram g_latency;
+
+	void usage()
+	{
+		std::cout << "loadgen - drives the Postmarks service through a loopback hub" << std::endl;
+		std::cout << "Usage: loadgen [OPTIONS]" << std::endl;
+		std::cout << "\t-r <rate> - requests a second, 0 for as fast as possible. Default 1000" << std::endl;
+		std::cout << "\t-n <count> - requests to send. Default 100000" << std::endl;
+		std::cout << "\t-d <count> - devices given a postmark before the run. Default 10000" << std::endl;
+		std::cout << "\t-p <percent> - of requests from those devices, the rest are new. Default 50" << std::endl;
+		std::cout << "\t-q <percent> - of requests asking for a particular postmark. Default 0" << std::endl;
+		std::cout << "\t-s <store> - DbFile for the generated config. Default memory:" << std::endl;
+		std::cout << "\t-c <config file> - Postmarks configuration to use instead of generating one" << std::endl;
+		std::cout << "\t-w <seconds> - to wait for answers. Default 30" << std::endl;
+		std::cout << "\t-l <log file> - for the service. Default loadgen.log" << std::endl;
+		std::cout << "\t-x <seed> - for the device and postmark choices. Default 1" << std::endl;
+	}
+
+	bool parseCmdLine(int argc, char* argv[], Options& o)
+	{
+		for (int x = 1; x < argc; ++x)
+		{
+			std::string a = argv[x];
+			if (a.size() != 2 || a[0] != '-' || x + 1 >= argc)
+			{
+				usage();
+				return false;
+			}
+
+			const char* v = argv[++x];
+			switch (a[1])
+			{
+			case 'r': o.rate = std::strtod(v, nullptr); break;
+			case 'n': o.requests = std::strtoull(v, nullptr, 10); break;
+			case 'd': o.devices = (uint32_t)std::strtoul(v, nullptr, 10); break;
+			case 'p': o.returning = std::atoi(v); break;
+			case 'q': o.requested = std::atoi(v); break;
+			case 's': o.store = v; break;
+			case 'c': o.cfgFile = v; break;
+			case 'w': o.wait = std::atoi(v); break;
+			case 'l': o.logFile = v; break;
+			case 'x': o.seed = (unsigned)std::strtoul(v, nullptr, 10); break;
+			default:
+				usage();
+				return false;
+			}
+		}
+
+		if (o.devices == 0)
+			o.returning = 0;
+		return true;
+	}
+
+	std::string config(const Options& o)
+	{
+		if (!o.cfgFile.empty())
+		{
+			std::ifstream f(o.cfgFile);
+			std::stringstream s;
+			s << f.rdbuf();
+			return s.str();
+		}
+
+		std::ostringstream s;
+		s << "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+			<< "<pm:Postmarks xmlns:pm=\"PmConfig\">"
+			<< "<DbFile>" << o.store << "</DbFile>"
+			<< "<StatusInterval>0</StatusInterval>"
+			<< "<range from=\"1\" to=\"" << o.rangeTo << "\"/>"
+			<< "</pm:Postmarks>";
+		return s.str();
+	}
+
+	std::string request(const std::string& devId, uint32_t requested)
+	{
+		postmarks::pmReq req;
+		req.devId(devId);
+		if (requested)
+			req.requested(requested);
+
+		postmarks::pmReq_saggr s;
+		xml_schema::document_simpl d(s.root_serializer(), s.root_name());
+
+		std::ostringstream strm;
+		s.pre(req);
+		d.serialize(strm, 0);
+		return strm.str();
+	}
+
+	void send(const std::string& devId, uint32_t requested, Clock::time_point due)
+	{
+		std::string payload = request(devId, requested);
+		{
+			std::lock_guard<std::mutex> lk(g_lk);
+			g_pending[devId].push_back(due);
+		}
+		HubApps::Loopback::bus().publish(PubSub::Message{ PUB_PMREQ, payload });
+	}
+
+	void received(const PubSub::Message& m)
+	{
+		if (!PubSub::match(SUB_PMRSP, m.subject))
+			return;
+
+		Clock::time_point now = Clock::now();
+
+		postmarks::pmRsp rsp;
+		try
+		{
+			postmarks::pmRsp_paggr s;
+			xml_schema::document_pimpl d(s.root_parser(), s.root_name());
+			std::istringstream strm(m.payload);
+			s.pre();
+			d.parse(strm);
+			rsp = s.post();
+		}
+		catch (xml_schema::parser_exception& ex)
+		{
+			std::cout << "Bad response: " << ex.text() << std::endl;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lk(g_lk);
+		if (rsp.devId() == PROBE)
+		{
+			g_probed = g_probed || rsp.pm_present();
+			g_cv.notify_all();
+			return;
+		}
+
+		std::unordered_map<std::string, std::deque<Clock::time_point> >::iterator it = g_pending.find(rsp.devId());
+		if (it == g_pending.end())
+			return; // republished by the service, not asked for
+
+		if (g_measuring)
+			g_latency.record(now - it->second.front());
+		it->second.pop_front();
+		if (it->second.empty())
+			g_pending.erase(it);
+
+		++g_answered;
+		if (!rsp.pm_present())
+			++g_unassigned;
+		g_cv.notify_all();
+	}
+
+	// Until every request sent has been answered, or the wait runs out
+	bool drain(uint64_t sent, int wait)
+	{
+		std::unique_lock<std::mutex> lk(g_lk);
+		return g_cv.wait_for(lk, std::chrono::seconds(wait), [sent]() { return g_answered >= sent; });
+	}
+
+	double seconds(Clock::duration d)
+	{
+		return std::chrono::duration<double>(d).count();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options o;
+	if (!parseCmdLine(argc, argv, o))
+		return -1;
+
+	Logging::LogFile log;
+	if (!o.logFile.empty())
+		log.open(o.logFile);
+
+	HubApps::Loopback::bus().listen(received);
+
+	Postmarks svc(log, "loopback");
+	svc.start();
+	HubApps::Loopback::bus().publish(PubSub::Message{ PUB_CFG, config(o) });
+
+	// Configuration is applied on the dispatcher, so ask until there is a range
+	// to assign from
+	Clock::time_point giveUp = Clock::now() + std::chrono::seconds(o.wait);
+	while (true)
+	{
+		HubApps::Loopback::bus().publish(PubSub::Message{ PUB_PMREQ, request(PROBE, 0) });
+		std::unique_lock<std::mutex> lk(g_lk);
+		if (g_cv.wait_for(lk, std::chrono::milliseconds(100), []() { return g_probed; }))
+			break;
+		if (Clock::now() > giveUp)
+		{
+			std::cout << "The service never took the configuration. See " << o.logFile << std::endl;
+			svc.stop();
+			return -1;
+		}
+	}
+
+	// Devices that come back during the run
+	Clock::time_point t = Clock::now();
+	for (uint32_t i = 0; i < o.devices; ++i)
+		send("dev-" + std::to_string(i), 0, Clock::now());
+	if (!drain(o.devices, o.wait))
+	{
+		std::cout << "Only " << g_answered << " of " << o.devices << " devices were given postmarks" << std::endl;
+		svc.stop();
+		return -1;
+	}
+	std::cout << "Gave " << o.devices << " devices postmarks in " << seconds(Clock::now() - t) << "s" << std::endl;
+
+	{
+		std::lock_guard<std::mutex> lk(g_lk);
+		g_answered = 0;
+		g_unassigned = 0;
+		g_measuring = true;
+	}
+
+	std::mt19937 rng(o.seed);
+	std::uniform_int_distribution<int> pct(0, 99);
+	std::uniform_int_distribution<uint32_t> known(0, o.devices ? o.devices - 1 : 0);
+	std::uniform_int_distribution<uint32_t> pm(1, o.rangeTo);
+
+	Clock::duration interval = o.rate > 0 ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / o.rate)) : Clock::duration::zero();
+	Clock::duration behind = Clock::duration::zero();
+	uint64_t fresh = 0;
+
+	Clock::time_point start = Clock::now();
+	for (uint64_t i = 0; i < o.requests; ++i)
+	{
+		Clock::time_point due = start + interval * i;
+		Clock::time_point now = Clock::now();
+		if (interval == Clock::duration::zero())
+			due = now;
+		else if (due > now)
+			std::this_thread::sleep_until(due);
+		else if (now - due > behind)
+			behind = now - due;
+
+		std::string devId = pct(rng) < o.returning ? "dev-" + std::to_string(known(rng)) : "new-" + std::to_string(fresh++);
+		send(devId, pct(rng) < o.requested ? pm(rng) : 0, due);
+	}
+	Clock::time_point sent = Clock::now();
+
+	bool all = drain(o.requests, o.wait);
+	Clock::time_point done = Clock::now();
+
+	svc.stop();
+
+	std::lock_guard<std::mutex> lk(g_lk);
+	std::cout << "Sent " << o.requests << " requests in " << seconds(sent - start) << "s, " << o.requests / seconds(sent - start) << "/s";
+	if (behind > Clock::duration::zero())
+		std::cout << ", up to " << seconds(behind) * 1000 << "ms behind schedule";
+	std::cout << std::endl;
+	std::cout << "Answered " << g_answered << " in " << seconds(done - start) << "s, " << g_answered / seconds(done - start) << "/s, "
+		<< g_unassigned << " without a postmark" << std::endl;
+	if (!all)
+		std::cout << o.requests - g_answered << " not answered within " << o.wait << "s" << std::endl;
+	std::cout << "Latency " << g_latency.summary(false) << std::endl;
+
+	return all ? 0 : 1;
+}
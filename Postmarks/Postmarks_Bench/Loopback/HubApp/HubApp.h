@@ -0,0 +1,155 @@
+#pragma once
+
+#include "PubSubLib/PubSub.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Stands in for the pSub hub so the service can be driven without one. With
+// this directory ahead of the workspace on the include path, an app built
+// from source gets this HubApp in place of the real one: nothing goes near a
+// socket and every app in the process shares one bus.
+//
+// Subscriptions are matched with PubSub::match() as the hub would. Messages
+// are delivered straight into the subscriber's receiveEvent() on the
+// publishing thread. TTLs are carried but nothing is retained.
+namespace HubApps
+{
+	enum class HubConnectionState { HubAvailable, HubUnavailable };
+
+	class HubApp;
+
+	class Loopback
+	{
+	public:
+		typedef std::function<void(const PubSub::Message&)> Listener;
+
+		static Loopback& bus()
+		{
+			static Loopback b;
+			return b;
+		}
+
+		// Sees everything any app sends, on whichever thread sent it
+		void listen(Listener l)
+		{
+			std::lock_guard<std::recursive_mutex> lk(m_lk);
+			std::shared_ptr<std::vector<Listener> > ls = std::make_shared<std::vector<Listener> >(*m_listeners);
+			ls->push_back(std::move(l));
+			m_listeners = ls;
+		}
+
+		// To every started app with a matching subscription
+		inline void publish(const PubSub::Message& m);
+
+	private:
+		friend class HubApp;
+
+		std::recursive_mutex m_lk; // recursive so a subscriber can send or publish from receiveEvent()
+		std::vector<HubApp*> m_apps;
+		std::shared_ptr<const std::vector<Listener> > m_listeners{std::make_shared<std::vector<Listener> >()};
+
+		Loopback() {}
+
+		void sent(const PubSub::Message& m)
+		{
+			// Listeners are called without the lock so they can publish
+			std::shared_ptr<const std::vector<Listener> > ls;
+			{
+				std::lock_guard<std::recursive_mutex> lk(m_lk);
+				ls = m_listeners;
+			}
+			for (const Listener& l : *ls)
+				l(m);
+		}
+	};
+
+	class HubApp
+	{
+		friend class Loopback;
+
+		std::function<void(PubSub::Message&&)> m_receive;
+		std::function<void(HubConnectionState)> m_connected;
+		std::vector<PubSub::Subject> m_subs; // under the bus lock
+		bool m_started = false;
+
+	public:
+		template <class T> HubApp(T& app, const std::string& /*psubAddr*/)
+			: m_receive([&app](PubSub::Message&& m) { app.receiveEvent(std::move(m)); })
+			, m_connected([&app](HubConnectionState s) { app.eventBusConnected(s); })
+		{
+		}
+
+		~HubApp()
+		{
+			stop();
+		}
+
+		void start()
+		{
+			{
+				Loopback& b = Loopback::bus();
+				std::lock_guard<std::recursive_mutex> lk(b.m_lk);
+				if (m_started)
+					return;
+				m_started = true;
+				m_subs.clear();
+				b.m_apps.push_back(this);
+			}
+			m_connected(HubConnectionState::HubAvailable);
+		}
+
+		void stop()
+		{
+			{
+				Loopback& b = Loopback::bus();
+				std::lock_guard<std::recursive_mutex> lk(b.m_lk);
+				if (!m_started)
+					return;
+				m_started = false;
+				for (std::vector<HubApp*>::iterator it = b.m_apps.begin(); it != b.m_apps.end(); ++it)
+				{
+					if (*it == this)
+					{
+						b.m_apps.erase(it);
+						break;
+					}
+				}
+			}
+			m_connected(HubConnectionState::HubUnavailable);
+		}
+
+		void subscribe(const PubSub::Subject& subject)
+		{
+			std::lock_guard<std::recursive_mutex> lk(Loopback::bus().m_lk);
+			m_subs.push_back(subject);
+		}
+
+		void sendMsg(const PubSub::Message& m)
+		{
+			Loopback::bus().sent(m);
+		}
+	};
+
+	void Loopback::publish(const PubSub::Message& m)
+	{
+		// Delivered under the lock so no app sees a message after stop()
+		std::lock_guard<std::recursive_mutex> lk(m_lk);
+		for (HubApp* a : m_apps)
+		{
+			for (const PubSub::Subject& s : a->m_subs)
+			{
+				if (PubSub::match(s, m.subject))
+				{
+					PubSub::Message copy(m);
+					a->m_receive(std::move(copy));
+					break;
+				}
+			}
+		}
+	}
+}
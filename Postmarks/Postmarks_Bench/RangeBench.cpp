@@ -0,0 +1,220 @@
+// Times NumericRangeHandler against synthetic workloads, to catch regressions
+// in the range arithmetic on the targets postmarksd runs on.
+//
+// Each workload builds a handler of n numbers with a different shape of free
+// space and then times every operation on it:
+//   sequential - filled from the bottom, one free range
+//   churn      - filled, then random numbers released and the lowest reused
+//   holes      - every other number used, the most ranges n numbers can make
+//
+// Usage: rangebench [max numbers] [seed]
+// Sizes go up in tens from 1000 to max numbers, 10M by default.
+
+#include "Postmarks/NumericRangeHandler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <functional>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef Nmrh::NumericRangeHandler<uint32_t> Handler;
+
+// Every allocation is counted so the memory column is what the handler holds,
+// not what the allocator has kept back
+namespace
+{
+	std::atomic<int64_t> g_heap{0};
+	const size_t HDR = alignof(std::max_align_t) > sizeof(size_t) ? alignof(std::max_align_t) : sizeof(size_t);
+}
+
+void* operator new(size_t n)
+{
+	char* p = (char*)std::malloc(n + HDR);
+	if (!p)
+		throw std::bad_alloc();
+	*(size_t*)p = n;
+	g_heap += n;
+	return p + HDR;
+}
+
+void operator delete(void* p) noexcept
+{
+	if (!p)
+		return;
+	char* b = (char*)p - HDR;
+	g_heap -= *(size_t*)b;
+	std::free(b);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+namespace
+{
+	const size_t MAX_OPS = 1000000; // per measurement of an O(log n) operation
+	const size_t MAX_PASSES = 1000; // per measurement of an O(ranges) operation
+
+	volatile uint64_t g_sink; // keeps results from being optimised away
+
+	struct Workload
+	{
+		const char* name;
+		std::function<void(Handler&, uint32_t, std::mt19937&)> build;
+	};
+
+	void report(const char* workload, uint32_t n, const char* op, size_t ops, std::chrono::steady_clock::duration d)
+	{
+		double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / (ops ? ops : 1);
+		std::printf("%-10s %9u  %-16s %12.1f %10zu\n", workload, n, op, ns, ops);
+	}
+
+	template <class F> void time(const char* workload, uint32_t n, const char* op, size_t ops, F f)
+	{
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < ops; ++i)
+			f(i);
+		report(workload, n, op, ops, std::chrono::steady_clock::now() - t);
+	}
+
+	void fillSequential(Handler& h, uint32_t n, std::mt19937&)
+	{
+		for (uint32_t i = 0; i < n; ++i)
+			h.addLowestUnused();
+	}
+
+	void fillChurn(Handler& h, uint32_t n, std::mt19937& rng)
+	{
+		// About as fragmented as a site gets after years of devices coming and
+		// going: a tenth released at random, half of those reused
+		fillSequential(h, n, rng);
+		std::uniform_int_distribution<uint32_t> pick(0, n - 1);
+		for (uint32_t i = 0; i < n / 10; ++i)
+			h.removeNum(pick(rng));
+		for (uint32_t i = 0; i < n / 20; ++i)
+			h.addLowestUnused();
+	}
+
+	void fillHoles(Handler& h, uint32_t n, std::mt19937&)
+	{
+		for (uint32_t i = 0; i < n; ++i)
+			h.addNum(i * 2);
+	}
+
+	void run(const Workload& w, uint32_t n, unsigned seed)
+	{
+		std::mt19937 rng(seed);
+		int64_t heap = g_heap;
+
+		Handler h;
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		w.build(h, n, rng);
+		report(w.name, n, "build", n, std::chrono::steady_clock::now() - t);
+
+		size_t ranges = h.getRanges().getRangeSet().size();
+		std::printf("%-10s %9u  %-16s %12zu bytes, %zu used ranges\n", w.name, n, "memory", (size_t)(g_heap - heap), ranges);
+
+		size_t ops = std::min<size_t>(n, MAX_OPS);
+		uint32_t span = n * 2; // covers the holes workload too
+		std::vector<uint32_t> nums(ops);
+		std::uniform_int_distribution<uint32_t> pick(0, span - 1);
+		for (uint32_t& x : nums)
+			x = pick(rng);
+
+		time(w.name, n, "contains", ops, [&](size_t i) { g_sink += h.contains(nums[i]); });
+
+		// Each release is undone straight away so the shape stays the same
+		time(w.name, n, "removeNum+addNum", ops, [&](size_t i)
+		{
+			if (h.removeNum(nums[i]))
+				h.addNum(nums[i]);
+		});
+
+		// And these two undo each other
+		std::vector<uint32_t> added(ops);
+		time(w.name, n, "addLowestUnused", ops, [&](size_t i) { added[i] = h.addLowestUnused(); });
+		time(w.name, n, "removeNum", ops, [&](size_t i) { g_sink += h.removeNum(added[ops - 1 - i]); });
+
+		size_t passes = std::max<size_t>(1, std::min(MAX_PASSES, MAX_OPS / (ranges + 1)));
+		time(w.name, n, "getSize", passes, [&](size_t) { g_sink += h.getSize(); });
+		time(w.name, n, "getRanges", passes, [&](size_t) { g_sink += h.getRanges().getRangeSet().size(); });
+		time(w.name, n, "invert", passes, [&](size_t)
+		{
+			Handler::NumericRangeList l = h.getRanges();
+			g_sink += l.invert().getRangeSet().size();
+		});
+
+		// The range operators work on whole lists, so they are timed against a
+		// copy of the handler with a block taken out of the middle
+		Handler other(h);
+		other -= Handler::NumericRange(n / 4, n / 2);
+
+		time(w.name, n, "+= range", passes, [&](size_t)
+		{
+			Handler c(h);
+			c += Handler::NumericRange(n / 4, n / 2);
+			g_sink += c.contains(n / 4);
+		});
+		time(w.name, n, "-= range", passes, [&](size_t)
+		{
+			Handler c(h);
+			c -= Handler::NumericRange(n / 4, n / 2);
+			g_sink += c.contains(n / 4);
+		});
+		time(w.name, n, "+= handler", passes, [&](size_t)
+		{
+			Handler c(h);
+			c += other;
+			g_sink += c.contains(n / 4);
+		});
+		time(w.name, n, "-= handler", passes, [&](size_t)
+		{
+			Handler c(h);
+			c -= other;
+			g_sink += c.contains(n / 4);
+		});
+		time(w.name, n, "intersect", passes, [&](size_t)
+		{
+			Handler c(h);
+			c.intersect(other);
+			g_sink += c.contains(n / 4);
+		});
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t max = argc > 1 ? (uint32_t)std::strtoul(argv[1], nullptr, 10) : 10000000;
+	unsigned seed = argc > 2 ? (unsigned)std::strtoul(argv[2], nullptr, 10) : 1;
+	if (max < 1000 || max > 1000000000)
+	{
+		std::fprintf(stderr, "Usage: rangebench [max numbers, 1000 to 1000000000] [seed]\n");
+		return 1;
+	}
+
+	const Workload workloads[] = {
+		{ "sequential", fillSequential },
+		{ "churn", fillChurn },
+		{ "holes", fillHoles },
+	};
+
+	std::printf("%-10s %9s  %-16s %12s %10s\n", "workload", "size", "op", "ns/op", "ops");
+	for (uint32_t n = 1000; n <= max; n *= 10)
+	{
+		for (const Workload& w : workloads)
+			run(w, n, seed);
+		if (n > max / 10)
+			break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,371 @@
+// Measures how the assignment path scales with dispatcher threads and with
+// configured ranges, through the loopback hub in place of pSub. Every request
+// is from a new device, so each one is parsed, matched against the range
+// regexes, given a postmark and stored.
+//
+// Each cell of the sweep is a fresh service with that many workers and
+// ranges, driven closed loop with a fixed number of requests outstanding so
+// that added threads have work to take. Reported per cell:
+//   throughput - requests answered a second
+//   p99        - from sending a request to its Postmark.Response
+//   lock wait  - share of the time in the request path spent waiting on the
+//                dispatcher lock rather than working, flagged where it is
+//                the greater part
+//
+// The store is memory: so the numbers are the dispatcher's and not the disk's.
+
+#include "Postmarks/Postmarks.h"
+#include "Postmarks/Latency.h"
+#include "postmark-pimpl.hxx"
+#include "postmark-simpl.hxx"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	const PubSub::Subject PUB_CFG{ "CFG", "Postmarks" };
+	const PubSub::Subject PUB_PMREQ{ "_", "Postmark", "Request" };
+	const PubSub::Subject SUB_PMRSP{ "Postmark", "Response" };
+
+	const char* const PROBE = "r0-probe"; // has to fit a range
+	const double CONTENDED = 0.5; // lock wait share flagged
+
+	struct Options
+	{
+		int workers = 0; // up to, 0 for a thread per core
+		int ranges = 16; // up to
+		uint64_t requests = 100000; // per cell
+		size_t outstanding = 256;
+		int wait = 30; // seconds for the service to answer
+		std::string logFile = "scalebench.log";
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Result
+	{
+		bool ok;
+		double rate;
+		LatencyHistogram::Summary latency;
+		double lockShare;
+	};
+
+	// Responses are parsed off the service's threads, so the harness takes as
+	// little as possible of the time being measured
+	std::mutex g_inLk;
+	std::condition_variable g_inCv;
+	std::deque<std::pair<std::string, Clock::time_point> > g_inbox;
+	bool g_quit = false;
+
+	std::mutex g_lk;
+	std::condition_variable g_cv;
+	std::unordered_map<std::string, Clock::time_point> g_pending;
+	uint64_t g_answered = 0;
+	bool g_probed = false;
+	std::unique_ptr<LatencyHistogram> g_latency;
+
+	void usage()
+	{
+		std::cout << "scalebench - throughput and lock contention by worker threads and ranges" << std::endl;
+		std::cout << "Usage: scalebench [OPTIONS]" << std::endl;
+		std::cout << "\t-w <count> - most worker threads, doubling from 1. Default one per core" << std::endl;
+		std::cout << "\t-k <count> - most ranges, doubling from 1. Default 16" << std::endl;
+		std::cout << "\t-n <count> - requests per run. Default 100000" << std::endl;
+		std::cout << "\t-o <count> - requests outstanding at once. Default 256" << std::endl;
+		std::cout << "\t-t <seconds> - to wait for answers. Default 30" << std::endl;
+		std::cout << "\t-l <log file> - for the service. Default scalebench.log" << std::endl;
+	}
+
+	bool parseCmdLine(int argc, char* argv[], Options& o)
+	{
+		for (int x = 1; x < argc; ++x)
+		{
+			std::string a = argv[x];
+			if (a.size() != 2 || a[0] != '-' || x + 1 >= argc)
+			{
+				usage();
+				return false;
+			}
+
+			const char* v = argv[++x];
+			switch (a[1])
+			{
+			case 'w': o.workers = std::atoi(v); break;
+			case 'k': o.ranges = std::atoi(v); break;
+			case 'n': o.requests = std::strtoull(v, nullptr, 10); break;
+			case 'o': o.outstanding = (size_t)std::strtoul(v, nullptr, 10); break;
+			case 't': o.wait = std::atoi(v); break;
+			case 'l': o.logFile = v; break;
+			default:
+				usage();
+				return false;
+			}
+		}
+
+		if (o.workers <= 0)
+			o.workers = std::max(1u, std::thread::hardware_concurrency());
+		if (o.ranges <= 0 || o.requests == 0 || o.outstanding == 0)
+		{
+			usage();
+			return false;
+		}
+		return true;
+	}
+
+	// 1, 2, 4 ... and max itself
+	std::vector<int> steps(int max)
+	{
+		std::vector<int> s;
+		for (int n = 1; n < max; n *= 2)
+			s.push_back(n);
+		s.push_back(max);
+		return s;
+	}
+
+	std::string config(const Options& o, int ranges)
+	{
+		uint32_t span = (uint32_t)(o.requests / ranges) + 1000;
+
+		std::ostringstream s;
+		s << "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+			<< "<pm:Postmarks xmlns:pm=\"PmConfig\">"
+			<< "<DbFile>memory:</DbFile>"
+			<< "<StatusInterval>0</StatusInterval>";
+		for (int r = 0; r < ranges; ++r)
+			s << "<range regex=\"r" << r << "-.*\" from=\"" << 1 + r * span << "\" to=\"" << (r + 1) * span << "\"/>";
+		s << "</pm:Postmarks>";
+		return s.str();
+	}
+
+	std::string request(const std::string& devId)
+	{
+		postmarks::pmReq req;
+		req.devId(devId);
+
+		postmarks::pmReq_saggr s;
+		xml_schema::document_simpl d(s.root_serializer(), s.root_name());
+
+		std::ostringstream strm;
+		s.pre(req);
+		d.serialize(strm, 0);
+		return strm.str();
+	}
+
+	void received(const PubSub::Message& m)
+	{
+		if (!PubSub::match(SUB_PMRSP, m.subject))
+			return;
+
+		Clock::time_point now = Clock::now();
+		std::lock_guard<std::mutex> lk(g_inLk);
+		g_inbox.emplace_back(m.payload, now);
+		g_inCv.notify_one();
+	}
+
+	void collect()
+	{
+		std::unique_lock<std::mutex> in(g_inLk);
+		while (true)
+		{
+			g_inCv.wait(in, []() { return g_quit || !g_inbox.empty(); });
+			if (g_inbox.empty())
+				return;
+			std::pair<std::string, Clock::time_point> m = std::move(g_inbox.front());
+			g_inbox.pop_front();
+			in.unlock();
+
+			postmarks::pmRsp rsp;
+			try
+			{
+				postmarks::pmRsp_paggr s;
+				xml_schema::document_pimpl d(s.root_parser(), s.root_name());
+				std::istringstream strm(m.first);
+				s.pre();
+				d.parse(strm);
+				rsp = s.post();
+			}
+			catch (xml_schema::parser_exception& ex)
+			{
+				std::cout << "Bad response: " << ex.text() << std::endl;
+				in.lock();
+				continue;
+			}
+
+			{
+				std::lock_guard<std::mutex> lk(g_lk);
+				if (rsp.devId() == PROBE)
+					g_probed = g_probed || rsp.pm_present();
+				else
+				{
+					std::unordered_map<std::string, Clock::time_point>::iterator it = g_pending.find(rsp.devId());
+					if (it != g_pending.end())
+					{
+						g_latency->record(m.second - it->second);
+						g_pending.erase(it);
+						++g_answered;
+					}
+				}
+				g_cv.notify_all();
+			}
+			in.lock();
+		}
+	}
+
+	double stageSeconds(const std::vector<Postmarks::StageTotal>& totals, const char* name)
+	{
+		for (const Postmarks::StageTotal& t : totals)
+		{
+			if (std::strcmp(t.name, name) == 0)
+				return t.seconds;
+		}
+		return 0;
+	}
+
+	Result run(const Options& o, int workers, int ranges, Logging::LogFile& log)
+	{
+		Result res{};
+		{
+			std::lock_guard<std::mutex> lk(g_lk);
+			g_pending.clear();
+			g_answered = 0;
+			g_probed = false;
+			g_latency.reset(new LatencyHistogram);
+		}
+
+		Postmarks svc(log, "loopback", workers);
+		svc.start();
+		HubApps::Loopback::bus().publish(PubSub::Message{ PUB_CFG, config(o, ranges) });
+
+		// Configuration is applied on the dispatcher, so ask until there is a
+		// range to assign from
+		Clock::time_point giveUp = Clock::now() + std::chrono::seconds(o.wait);
+		while (true)
+		{
+			HubApps::Loopback::bus().publish(PubSub::Message{ PUB_PMREQ, request(PROBE) });
+			std::unique_lock<std::mutex> lk(g_lk);
+			if (g_cv.wait_for(lk, std::chrono::milliseconds(100), []() { return g_probed; }))
+				break;
+			if (Clock::now() > giveUp)
+			{
+				std::cout << "The service never took the configuration. See " << o.logFile << std::endl;
+				svc.stop();
+				return res;
+			}
+		}
+
+		// Requests are built up front so the sender only ever waits on the
+		// service
+		std::vector<std::pair<std::string, std::string> > reqs(o.requests);
+		for (uint64_t i = 0; i < o.requests; ++i)
+		{
+			reqs[i].first = "r" + std::to_string(i % ranges) + "-" + std::to_string(i);
+			reqs[i].second = request(reqs[i].first);
+		}
+
+		Clock::time_point start = Clock::now();
+		for (const std::pair<std::string, std::string>& r : reqs)
+		{
+			{
+				std::unique_lock<std::mutex> lk(g_lk);
+				g_cv.wait(lk, [&o]() { return g_pending.size() < o.outstanding; });
+				g_pending[r.first] = Clock::now();
+			}
+			HubApps::Loopback::bus().publish(PubSub::Message{ PUB_PMREQ, r.second });
+		}
+
+		{
+			std::unique_lock<std::mutex> lk(g_lk);
+			res.ok = g_cv.wait_for(lk, std::chrono::seconds(o.wait), [&o]() { return g_answered >= o.requests; });
+			res.rate = g_answered / std::chrono::duration<double>(Clock::now() - start).count();
+			res.latency = g_latency->summary(false);
+		}
+
+		std::vector<Postmarks::StageTotal> totals = svc.stageTotals();
+		svc.stop();
+
+		// Queue is waiting for a thread and Write happens off the request path,
+		// so neither is counted as working
+		double lock = stageSeconds(totals, "lock");
+		double work = stageSeconds(totals, "parse") + stageSeconds(totals, "lookup") + stageSeconds(totals, "match")
+			+ stageSeconds(totals, "store") + stageSeconds(totals, "serialize") + stageSeconds(totals, "publish");
+		res.lockShare = lock + work > 0 ? lock / (lock + work) : 0;
+		return res;
+	}
+
+	void table(const char* title, const std::vector<int>& workers, const std::vector<int>& ranges, const std::vector<std::vector<Result> >& results, void (*cell)(const Result&))
+	{
+		std::printf("\n%s\n%8s", title, "ranges");
+		for (int w : workers)
+			std::printf(" %10d", w);
+		std::printf("  workers\n");
+
+		for (size_t r = 0; r < ranges.size(); ++r)
+		{
+			std::printf("%8d", ranges[r]);
+			for (const Result& res : results[r])
+				cell(res);
+			std::printf("\n");
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options o;
+	if (!parseCmdLine(argc, argv, o))
+		return -1;
+
+	Logging::LogFile log;
+	if (!o.logFile.empty())
+		log.open(o.logFile);
+
+	HubApps::Loopback::bus().listen(received);
+	std::thread collector(collect);
+
+	std::vector<int> workers = steps(o.workers);
+	std::vector<int> ranges = steps(o.ranges);
+	std::vector<std::vector<Result> > results(ranges.size());
+
+	bool all = true;
+	for (size_t r = 0; r < ranges.size(); ++r)
+	{
+		for (int w : workers)
+		{
+			Result res = run(o, w, ranges[r], log);
+			std::cout << w << " workers, " << ranges[r] << " ranges: " << (res.ok ? "" : "INCOMPLETE ") << (uint64_t)res.rate << "/s, " << res.latency << std::endl;
+			results[r].push_back(res);
+			all = all && res.ok;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(g_inLk);
+		g_quit = true;
+		g_inCv.notify_one();
+	}
+	collector.join();
+
+	table("Throughput, requests/s", workers, ranges, results, [](const Result& r) { std::printf(" %10.0f", r.rate); });
+	table("Latency p99, us", workers, ranges, results, [](const Result& r) { std::printf(" %10.1f", r.latency.p99 / 1000.0); });
+	table("Lock wait, % of request path", workers, ranges, results, [](const Result& r) { std::printf(" %9.1f%c", r.lockShare * 100, r.lockShare > CONTENDED ? '!' : ' '); });
+	std::printf("\n! more time waiting on the dispatcher lock than working\n");
+	if (!all)
+		std::printf("Some runs were not answered in full within %ds, see above\n", o.wait);
+
+	return all ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+// Times how long the service takes to come up against a large db. Generates a
+// postmarks db of n devices spread over m ranges, then takes a configuration
+// on a fresh Postmarks against a copy of it, with each phase of startup timed:
+//   parse    - the configuration, and compiling the range regexes
+//   open     - the store
+//   scan     - the store reading rows
+//   classify - matching rows to ranges
+//   rebuild  - the occupancy and index
+//   purge    - committing the retags and deletes startup found
+//
+// A share of the rows are generated untagged, as left by older releases, and
+// a share fit no range at all, so classify and purge have real work to do.
+//
+// Usage: startbench [OPTIONS]
+
+#include "Postmarks/Postmarks.h"
+#include "Postmarks/PmStore.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+	struct Options
+	{
+		uint32_t devices = 1000000;
+		uint32_t ranges = 10;
+		int tagged = 50; // percent of rows recorded against their range
+		int stale = 5; // percent of rows that fit no range
+		std::string db = "startbench.db";
+		int runs = 3;
+		std::string logFile = "startbench.log";
+		unsigned seed = 1;
+	};
+
+	const uint32_t BATCH = 10000; // rows per transaction when generating
+
+	void usage()
+	{
+		std::cout << "startbench - times startup against a generated postmarks db" << std::endl;
+		std::cout << "Usage: startbench [OPTIONS]" << std::endl;
+		std::cout << "\t-n <count> - devices in the db. Default 1000000" << std::endl;
+		std::cout << "\t-m <count> - ranges they are spread over. Default 10" << std::endl;
+		std::cout << "\t-t <percent> - of rows recorded against their range. Default 50" << std::endl;
+		std::cout << "\t-s <percent> - of rows fitting no range. Default 5" << std::endl;
+		std::cout << "\t-f <db file> - SQLite, generated once and copied for each run. Default startbench.db" << std::endl;
+		std::cout << "\t-r <count> - runs. Default 3" << std::endl;
+		std::cout << "\t-l <log file> - for the service. Default startbench.log" << std::endl;
+		std::cout << "\t-x <seed> - for which rows are tagged or stale. Default 1" << std::endl;
+	}
+
+	bool parseCmdLine(int argc, char* argv[], Options& o)
+	{
+		for (int x = 1; x < argc; ++x)
+		{
+			std::string a = argv[x];
+			if (a.size() != 2 || a[0] != '-' || x + 1 >= argc)
+			{
+				usage();
+				return false;
+			}
+
+			const char* v = argv[++x];
+			switch (a[1])
+			{
+			case 'n': o.devices = (uint32_t)std::strtoul(v, nullptr, 10); break;
+			case 'm': o.ranges = (uint32_t)std::strtoul(v, nullptr, 10); break;
+			case 't': o.tagged = std::atoi(v); break;
+			case 's': o.stale = std::atoi(v); break;
+			case 'f': o.db = v; break;
+			case 'r': o.runs = std::atoi(v); break;
+			case 'l': o.logFile = v; break;
+			case 'x': o.seed = (unsigned)std::strtoul(v, nullptr, 10); break;
+			default:
+				usage();
+				return false;
+			}
+		}
+
+		if (o.devices == 0 || o.ranges == 0 || o.runs <= 0)
+		{
+			usage();
+			return false;
+		}
+		return true;
+	}
+
+	// Range r holds devices "r<r>-<i>" in its own block of numbers, with room
+	// to spare so nothing is ever full
+	uint32_t perRange(const Options& o)
+	{
+		return o.devices / o.ranges * 2 + 1000;
+	}
+
+	std::string regex(uint32_t r)
+	{
+		return "r" + std::to_string(r) + "-.*";
+	}
+
+	uint32_t from(const Options& o, uint32_t r)
+	{
+		return 1 + r * perRange(o);
+	}
+
+	uint32_t to(const Options& o, uint32_t r)
+	{
+		return from(o, r) + perRange(o) - 1;
+	}
+
+	std::string config(const Options& o, const std::string& db)
+	{
+		std::ostringstream s;
+		s << "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+			<< "<pm:Postmarks xmlns:pm=\"PmConfig\">"
+			<< "<DbFile>" << db << "</DbFile>"
+			<< "<StatusInterval>0</StatusInterval>";
+		for (uint32_t r = 0; r < o.ranges; ++r)
+			s << "<range regex=\"" << regex(r) << "\" from=\"" << from(o, r) << "\" to=\"" << to(o, r) << "\"/>";
+		s << "</pm:Postmarks>";
+		return s.str();
+	}
+
+	bool generate(const Options& o, Logging::LogFile& log)
+	{
+		std::remove(o.db.c_str());
+		std::unique_ptr<PmStore> store = PmStore::create(o.db, log);
+		if (!store || !store->open(o.db))
+		{
+			std::cout << "Can't create " << o.db << std::endl;
+			return false;
+		}
+
+		std::mt19937 rng(o.seed);
+		std::uniform_int_distribution<int> pct(0, 99);
+
+		// Stale rows keep numbers inside a range, so they are only rejected by
+		// the regex, as a device renamed out of its range would be
+		std::vector<uint32_t> next(o.ranges);
+		for (uint32_t r = 0; r < o.ranges; ++r)
+			next[r] = from(o, r);
+
+		bool ok = store->begin();
+		for (uint32_t i = 0; ok && i < o.devices; ++i)
+		{
+			uint32_t r = i % o.ranges;
+			uint32_t pm = next[r]++;
+			if (pct(rng) < o.stale)
+				ok = store->upsert("stale-" + std::to_string(i), pm, 0);
+			else
+				ok = store->upsert("r" + std::to_string(r) + "-" + std::to_string(i), pm, pct(rng) < o.tagged ? Postmarks::rangeId(regex(r), from(o, r), to(o, r)) : 0);
+
+			if (ok && (i + 1) % BATCH == 0)
+				ok = store->commit() && store->begin();
+		}
+		ok = ok && store->commit();
+		store->close();
+
+		if (!ok)
+			std::cout << "Failed writing " << o.db << std::endl;
+		return ok;
+	}
+
+	bool copy(const std::string& src, const std::string& dst)
+	{
+		std::ifstream in(src, std::ios::binary);
+		std::ofstream out(dst, std::ios::binary | std::ios::trunc);
+		if (!in || !out)
+			return false;
+		out << in.rdbuf();
+		return (bool)out;
+	}
+
+	double ms(std::chrono::steady_clock::duration d)
+	{
+		return std::chrono::duration<double, std::milli>(d).count();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options o;
+	if (!parseCmdLine(argc, argv, o))
+		return -1;
+
+	Logging::LogFile log;
+	if (!o.logFile.empty())
+		log.open(o.logFile);
+
+	std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+	if (!generate(o, log))
+		return -1;
+	std::cout << "Generated " << o.devices << " devices over " << o.ranges << " ranges in " << ms(std::chrono::steady_clock::now() - t) / 1000 << "s" << std::endl;
+
+	// Each run starts from the same db, as startup changes it
+	std::string db = o.db + ".run";
+	std::string cfg = config(o, db);
+
+	std::printf("%4s %10s %10s %10s %10s %10s %10s %10s %10s %9s %9s\n", "run", "parse", "open", "scan", "classify", "rebuild", "purge", "total ms", "rows", "retagged", "rejected");
+	for (int run = 1; run <= o.runs; ++run)
+	{
+		if (!copy(o.db, db))
+		{
+			std::cout << "Can't copy " << o.db << " to " << db << std::endl;
+			return -1;
+		}
+
+		Postmarks svc(log);
+		Postmarks::StartupTimes times;
+		t = std::chrono::steady_clock::now();
+		if (!svc.configureTimed(cfg, times))
+		{
+			std::cout << "The configuration was not taken. See " << o.logFile << std::endl;
+			return -1;
+		}
+		std::chrono::steady_clock::duration total = std::chrono::steady_clock::now() - t;
+
+		std::printf("%4d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10zu %9zu %9zu\n", run,
+			ms(times.parse), ms(times.open), ms(times.scan), ms(times.classify), ms(times.rebuild), ms(times.purge), ms(total),
+			times.rows, times.retagged, times.rejected);
+		svc.stop();
+	}
+
+	std::remove(db.c_str());
+	return 0;
+}
@@ -3,6 +3,19 @@
 #include "Postmarks/Postmarks.h"
 #include "Task/lock.h"
 
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <ctime>
+#include <unistd.h>
+
 #define DAEMON_NAME "postmarksd"
 
 namespace Logging
@@ -13,12 +26,25 @@ namespace Logging
 
 void usage();
 bool parseCmdLine(int argc, char *argv[]);
+int transfer();
+int replay();
+int statsListen();
+void statsServe(int fd, Postmarks& disp, std::atomic<bool>& stop);
+void traceSetup();
 
 bool g_exe{false};
 std::string g_psubaddr("127.0.0.1");
 std::string g_version = "1.2.5";
 std::string g_cfgfile("./SystemConfig.xml");
 std::string g_diffpath(".");
+std::string g_exportFile;
+std::string g_importFile;
+std::string g_statsSocket;
+std::string g_recordFile;
+std::string g_replayFile;
+bool g_replayFast{false};
+bool g_cfgGiven{false};
+volatile sig_atomic_t g_dumpTrace = 0; // set by SIGUSR1
 
 std::string logfilen{DAEMON_NAME ".log"};
 Logging::LogFile logfile;
@@ -30,6 +56,14 @@ int main(int argc, char* argv[])
 	if (!parseCmdLine(argc, argv))
 		return -1;
 
+	// Bulk transfer runs once against the configured db and exits
+	if (!g_exportFile.empty() || !g_importFile.empty())
+		return transfer();
+
+	// So does replaying a recording, without connecting to the bus
+	if (!g_replayFile.empty())
+		return replay();
+
 	/* Debug logging
 	setlogmask(LOG_UPTO(LOG_DEBUG));
 	openlog(DAEMON_NAME, LOG_CONS, LOG_USER);
@@ -50,6 +84,7 @@ int main(int argc, char* argv[])
 	}
 
 	VEvent& stopEvent = signalSetup();
+	traceSetup();
 
 	if (!logfilen.empty())
 		logfile.open(logfilen);
@@ -62,13 +97,36 @@ int main(int argc, char* argv[])
 	LOGTO(logfile, Logging::LL_Info, Logging::LC_Service, "*************************************************************************************");
 
 	Postmarks disp(logfile, g_psubaddr);
+	if (!g_recordFile.empty())
+		disp.record(g_recordFile);
 	disp.start();
 
-	while(!stopEvent.timedwait(10000))
-		syslog(LOG_INFO, DAEMON_NAME " alive");
+	std::atomic<bool> statsStop{false};
+	std::thread stats;
+	int statsFd = g_statsSocket.empty() ? -1 : statsListen();
+	if (statsFd >= 0)
+		stats = std::thread(statsServe, statsFd, std::ref(disp), std::ref(statsStop));
+
+	// Wakes every second so a SIGUSR1 is acted on promptly
+	while(!stopEvent.timedwait(1000))
+	{
+		if (g_dumpTrace)
+		{
+			g_dumpTrace = 0;
+			disp.dumpTrace(DAEMON_NAME "-" + std::to_string(std::time(nullptr)) + ".trace");
+		}
+	}
 
 	LOGTO(logfile, Logging::LL_Info, Logging::LC_Service, "main loop finished. Stopping dispatcher");
 
+	if (stats.joinable())
+	{
+		statsStop = true;
+		stats.join();
+		close(statsFd);
+		unlink(g_statsSocket.c_str());
+	}
+
 	disp.stop();
 
 	LOGTO(logfile, Logging::LL_Info, Logging::LC_Service, "Shut down complete.  Exit");
@@ -111,6 +169,9 @@ bool parseCmdLine(int argc, char *argv[])
 				case 'e': // run as exe
 					g_exe = true;
 					break;
+				case 'f': // replay as fast as possible
+					g_replayFast = true;
+					break;
 				case 'b':
 					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
 						g_psubaddr = argv[x];
@@ -121,6 +182,69 @@ bool parseCmdLine(int argc, char *argv[])
 						return false;
 					}
 					break;
+				case 'c': // config file for export and import
+					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
+					{
+						g_cfgfile = argv[x];
+						g_cfgGiven = true;
+					}
+					else
+					{
+						std::cout << "Invalid command line parameters" << std::endl;
+						usage();
+						return false;
+					}
+					break;
+				case 'x': // export to file
+					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
+						g_exportFile = argv[x];
+					else
+					{
+						std::cout << "Invalid command line parameters" << std::endl;
+						usage();
+						return false;
+					}
+					break;
+				case 'i': // import from file
+					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
+						g_importFile = argv[x];
+					else
+					{
+						std::cout << "Invalid command line parameters" << std::endl;
+						usage();
+						return false;
+					}
+					break;
+				case 's': // stats socket
+					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
+						g_statsSocket = argv[x];
+					else
+					{
+						std::cout << "Invalid command line parameters" << std::endl;
+						usage();
+						return false;
+					}
+					break;
+				case 'r': // record inbound messages
+					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
+						g_recordFile = argv[x];
+					else
+					{
+						std::cout << "Invalid command line parameters" << std::endl;
+						usage();
+						return false;
+					}
+					break;
+				case 'p': // replay a recording
+					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
+						g_replayFile = argv[x];
+					else
+					{
+						std::cout << "Invalid command line parameters" << std::endl;
+						usage();
+						return false;
+					}
+					break;
 				case 'l': // specify log file
 					if (y == optlen - 1 && ++x < argc && argv[x][0] != '-')
 						logfilen = argv[x];
@@ -143,6 +267,162 @@ bool parseCmdLine(int argc, char *argv[])
 	return ret;
 }
 
+int transfer()
+{
+	if (!logfilen.empty())
+		logfile.open(logfilen);
+
+	std::ifstream cfg(g_cfgfile);
+	if (!cfg)
+	{
+		std::cout << "Can't read config file " << g_cfgfile << std::endl;
+		return -1;
+	}
+	std::stringstream cfgStr;
+	cfgStr << cfg.rdbuf();
+
+	Postmarks disp(logfile, g_psubaddr);
+
+	bool ok = true;
+	if (!g_exportFile.empty())
+	{
+		ok = disp.exportPostmarks(cfgStr.str(), g_exportFile);
+		std::cout << (ok ? "Exported to " : "Export failed to ") << g_exportFile << std::endl;
+	}
+	if (ok && !g_importFile.empty())
+	{
+		ok = disp.importPostmarks(cfgStr.str(), g_importFile);
+		std::cout << (ok ? "Imported from " : "Import failed from ") << g_importFile << std::endl;
+	}
+
+	if (!ok)
+		std::cout << "See " << logfilen << " for details" << std::endl;
+	return ok ? 0 : -1;
+}
+
+int replay()
+{
+	if (!logfilen.empty())
+		logfile.open(logfilen);
+
+	// The recording holds the configuration it was sent, db and all. -c points
+	// the replay somewhere else, a copy of the db say
+	std::string cfgStr;
+	if (g_cfgGiven)
+	{
+		std::ifstream cfg(g_cfgfile);
+		if (!cfg)
+		{
+			std::cout << "Can't read config file " << g_cfgfile << std::endl;
+			return -1;
+		}
+		std::stringstream s;
+		s << cfg.rdbuf();
+		cfgStr = s.str();
+	}
+
+	Postmarks disp(logfile, g_psubaddr);
+	disp.start(false);
+	bool ok = disp.replay(g_replayFile, !g_replayFast, cfgStr);
+	disp.stop();
+
+	std::cout << (ok ? "Replayed " : "Replay failed from ") << g_replayFile << ", see " << logfilen << " for details" << std::endl;
+	return ok ? 0 : -1;
+}
+
+int statsListen()
+{
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	if (g_statsSocket.size() >= sizeof(addr.sun_path))
+	{
+		LOGTO(logfile, Logging::LL_Warning, Logging::LC_Service, "Stats socket path too long: " << g_statsSocket);
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	std::strcpy(addr.sun_path, g_statsSocket.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		LOGTO(logfile, Logging::LL_Warning, Logging::LC_Service, "Can't create stats socket: " << std::strerror(errno));
+		return -1;
+	}
+
+	// Left behind by a previous run that didn't shut down
+	unlink(addr.sun_path);
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0)
+	{
+		LOGTO(logfile, Logging::LL_Warning, Logging::LC_Service, "Can't listen on stats socket " << g_statsSocket << ": " << std::strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	LOGTO(logfile, Logging::LL_Info, Logging::LC_Service, "Serving stats on " << g_statsSocket);
+	return fd;
+}
+
+void statsServe(int fd, Postmarks& disp, std::atomic<bool>& stop)
+{
+	while (!stop)
+	{
+		pollfd p{ fd, POLLIN, 0 };
+		if (poll(&p, 1, 500) <= 0)
+			continue;
+
+		int c = accept(fd, nullptr, nullptr);
+		if (c < 0)
+			continue;
+
+		// An HTTP scraper sends its request first and wants a response header.
+		// Anything else gets the text as soon as it connects
+		char req[512];
+		ssize_t n = 0;
+		pollfd cp{ c, POLLIN, 0 };
+		if (poll(&cp, 1, 100) > 0)
+			n = recv(c, req, sizeof(req), 0);
+
+		std::ostringstream body;
+		disp.metrics(body);
+
+		std::string out;
+		if (n >= 4 && !std::strncmp(req, "GET ", 4))
+			out = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.str().size()) + "\r\nConnection: close\r\n\r\n";
+		out += body.str();
+
+		for (size_t sent = 0; sent < out.size();)
+		{
+			ssize_t w = send(c, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+			if (w <= 0)
+				break;
+			sent += w;
+		}
+		close(c);
+	}
+}
+
+void traceSignal(int)
+{
+	// Only a flag, the dump itself is not async signal safe
+	g_dumpTrace = 1;
+}
+
+void traceSetup()
+{
+	struct sigaction sa;
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = traceSignal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, nullptr);
+
+	// Threads started after this inherit the mask, so any of them can take it
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+}
+
 void usage()
 {
 	using namespace std;
@@ -159,9 +439,24 @@ void usage()
 	cout << "\t-b <ip address> - bus address. Specifies the address of the psub server to connect to" << endl;
 	cout << "\t     If this option is not used the default will be the local host 127.0.0.1" << endl;
 	cout << "\t-l <log file> - log. Specifies the log file to produce." << endl;
+	cout << "\t-s <socket path> - stats. Serves counters and latency histograms in the Prometheus" << endl;
+	cout << "\t     text format to anything connecting to this Unix socket. Plain HTTP GETs are answered" << endl;
+	cout << "\t     too. Relative paths are under /tmp when running as a daemon" << endl;
+	cout << "\t-c <config file> - config. The Postmarks configuration to use with -x and -i." << endl;
+	cout << "\t     If this option is not used the default will be ./SystemConfig.xml" << endl;
+	cout << "\t-x <file> - export. Writes every assignment to the file and exits." << endl;
+	cout << "\t-i <file> - import. Reads assignments from the file into the db in one" << endl;
+	cout << "\t     transaction and exits. Devices or postmarks that fit no configured" << endl;
+	cout << "\t     range, or postmarks held by another device, are skipped." << endl;
+	cout << "\t     Files ending .csv are CSV (device,pm,range_id), anything else binary." << endl;
+	cout << "\t-r <file> - record. Captures every message received to the file while running." << endl;
+	cout << "\t-p <file> - replay. Feeds a recording through the service at the pace it was" << endl;
+	cout << "\t     recorded, without connecting to the bus, and exits. With -c the config file" << endl;
+	cout << "\t     replaces any configuration in the recording. Point it at a copy of the db." << endl;
+	cout << "\t-f - fast. Replays as fast as the service takes the messages." << endl;
 	cout << endl;
 	cout << "Multiple options can be grouped together e.g. -de sets logging level to debug and runs as an executable" << endl;
-	cout << "Options that require a value (-c, -l) must be at the end of an option group" << endl;
+	cout << "Options that require a value (-b, -c, -l, -s, -x, -i, -r, -p) must be at the end of an option group" << endl;
 	cout << "\te.g.  -el postmarks.log  will work but" << endl;
 	cout << "\t      -le postmarks.log  will fail" << endl;
 	cout << endl;
@@ -171,4 +466,7 @@ void usage()
 	cout << "override any previously set logging levels" << endl;
 	cout << "\te.g.  -dt ignores the 'd' and sets the logging level to TRACE" << endl;
 	cout << "\t      -td ignores the 't' and sets the logging level to DEBUG" << endl;
+	cout << endl;
+	cout << "Sending SIGUSR1 writes the stage times of the most recent requests to" << endl;
+	cout << DAEMON_NAME "-<time>.trace in the working directory (/tmp when running as a daemon)" << endl;
 }